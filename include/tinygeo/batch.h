@@ -0,0 +1,309 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include <vector>
+
+#include <tinygeo/raytrace.h>
+#include <tinygeo/parallel.h>
+#include <tinygeo/morton.h>
+
+namespace tinygeo {
+
+/** Structure-of-arrays storage for many segments and their results. Segment i runs from origin[i] to
+ *  origin[i] + direction[i], so lambda has the same meaning as for ray_trace(start, end, ...). */
+template<typename Num>
+struct RayBatch {
+	using P = Point<3, Num>;
+	
+	std::vector<Num> origin[3];
+	std::vector<Num> direction[3];
+	std::vector<Num> l_max;
+	
+	// Results, filled by trace_batch
+	std::vector<Num> lambda;
+	std::vector<size_t> index;
+	
+	RayBatch(size_t n = 0) { resize(n); }
+	
+	size_t size() const { return l_max.size(); }
+	
+	void resize(size_t n) {
+		for(size_t d = 0; d < 3; ++d) {
+			origin[d].resize(n);
+			direction[d].resize(n);
+		}
+		
+		l_max.resize(n);
+		lambda.resize(n);
+		index.resize(n);
+	}
+	
+	void set(size_t i, const P& start, const P& end, Num max) {
+		for(size_t d = 0; d < 3; ++d) {
+			origin[d][i] = start[d];
+			direction[d][i] = end[d] - start[d];
+		}
+		
+		l_max[i] = max;
+	}
+	
+	RaytraceResult<Num> result(size_t i) const {
+		return RaytraceResult<Num>(lambda[i], index[i]);
+	}
+};
+
+/** Order in which trace_batch forms packets */
+enum class RayOrder {
+	// Consecutive segments of the batch
+	keep,
+	// Segments sorted by ray_order_key within the bounding box of the tree. Results are still stored at
+	// the original positions.
+	morton
+};
+
+namespace internal {
+	/** A packet of rays traced together. Every operation loops over the lanes with the same instructions, so
+	 *  that the compiler can map the lanes onto SIMD registers. Unused lanes have l_max = -inf. */
+	template<typename Num, size_t width>
+	struct RayPacket {
+		Num origin[3][width];
+		Num dir[3][width];
+		Num inv_dir[3][width];
+		Num l_max[width];
+		Num lambda[width];
+		size_t index[width];
+		
+		// Loads the segments ids[begin], ... (begin, ... if ids is null)
+		void load(const RayBatch<Num>& batch, size_t begin, const size_t* ids) {
+			const size_t n = std::min(width, batch.size() - begin);
+			
+			// Directions within the tolerance of the box overload count as parallel, see the wide overload
+			const Num tol = 5 * std::numeric_limits<Num>::epsilon();
+			
+			for(size_t lane = 0; lane < width; ++lane) {
+				const bool used = lane < n;
+				const size_t id = !used ? 0 : ids ? ids[begin + lane] : begin + lane;
+				
+				for(size_t d = 0; d < 3; ++d) {
+					origin[d][lane] = used ? batch.origin[d][id] : 0;
+					dir[d][lane] = used ? batch.direction[d][id] : 1;
+					
+					Num safe_dir = dir[d][lane];
+					if(std::abs(safe_dir) <= tol)
+						safe_dir = std::copysign(std::numeric_limits<Num>::min(), safe_dir);
+					
+					inv_dir[d][lane] = 1 / safe_dir;
+				}
+				
+				l_max[lane] = used ? batch.l_max[id] : -std::numeric_limits<Num>::infinity();
+				lambda[lane] = std::numeric_limits<Num>::infinity();
+				index[lane] = RaytraceResult<Num>::no_hit;
+			}
+		}
+		
+		void store(RayBatch<Num>& batch, size_t begin, const size_t* ids) const {
+			const size_t n = std::min(width, batch.size() - begin);
+			
+			for(size_t lane = 0; lane < n; ++lane) {
+				const size_t id = ids ? ids[begin + lane] : begin + lane;
+				
+				batch.lambda[id] = lambda[lane];
+				batch.index[id] = index[lane];
+			}
+		}
+		
+		// Largest distance up to which any lane still accepts hits
+		Num limit() const {
+			Num result = -std::numeric_limits<Num>::infinity();
+			
+			for(size_t lane = 0; lane < width; ++lane)
+				result = std::max(result, std::min(lambda[lane], l_max[lane]));
+			
+			return result;
+		}
+		
+		// Slab test against all lanes. Returns the smallest entry distance of the lanes that hit the box,
+		// infinity if none does.
+		template<typename B>
+		Num intersect_box(const B& box) const {
+			Num t_low[width];
+			Num t_high[width];
+			
+			for(size_t lane = 0; lane < width; ++lane) {
+				t_low[lane] = 0;
+				t_high[lane] = std::min(lambda[lane], l_max[lane]);
+			}
+			
+			for(size_t d = 0; d < 3; ++d) {
+				const Num b_min = box.min()[d];
+				const Num b_max = box.max()[d];
+				
+				for(size_t lane = 0; lane < width; ++lane) {
+					const Num l1 = (b_min - origin[d][lane]) * inv_dir[d][lane];
+					const Num l2 = (b_max - origin[d][lane]) * inv_dir[d][lane];
+					
+					t_low[lane]  = std::max(t_low[lane],  std::min(l1, l2));
+					t_high[lane] = std::min(t_high[lane], std::max(l1, l2));
+				}
+			}
+			
+			Num result = std::numeric_limits<Num>::infinity();
+			for(size_t lane = 0; lane < width; ++lane)
+				result = std::min(result, t_low[lane] <= t_high[lane] ? t_low[lane] : std::numeric_limits<Num>::infinity());
+			
+			return result;
+		}
+		
+		// Moeller-Trumbore test of all lanes against one triangle. Performs the same operations as the
+		// single ray kernel, so hits agree with it (up to rounding if the compiler contracts into FMAs).
+		template<typename T>
+		void intersect_triangle(const T& tri) {
+			const PrecomputedTriangle<typename T::Point> data = triangle_data(tri, 0);
+			const auto& e1 = data.edge1;
+			const auto& e2 = data.edge2;
+			const size_t tri_index = triangle_index(tri, 0);
+			
+			for(size_t lane = 0; lane < width; ++lane) {
+				const Num d[3] = {dir[0][lane], dir[1][lane], dir[2][lane]};
+				
+				const Num p[3] = {
+					d[1] * e2[2] - d[2] * e2[1],
+					d[2] * e2[0] - d[0] * e2[2],
+					d[0] * e2[1] - d[1] * e2[0]
+				};
+				
+				const Num det = e1[0] * p[0] + e1[1] * p[1] + e1[2] * p[2];
+				const Num inv_det = 1 / det;
+				
+				const Num s[3] = {origin[0][lane] - data.origin[0], origin[1][lane] - data.origin[1], origin[2][lane] - data.origin[2]};
+				const Num u = (s[0] * p[0] + s[1] * p[1] + s[2] * p[2]) * inv_det;
+				
+				const Num q[3] = {
+					s[1] * e1[2] - s[2] * e1[1],
+					s[2] * e1[0] - s[0] * e1[2],
+					s[0] * e1[1] - s[1] * e1[0]
+				};
+				
+				const Num v = (d[0] * q[0] + d[1] * q[1] + d[2] * q[2]) * inv_det;
+				const Num l = (e2[0] * q[0] + e2[1] * q[1] + e2[2] * q[2]) * inv_det;
+				
+				const bool hit = det != 0 && u >= 0 && u <= 1 && v >= 0 && u + v <= 1 && l >= 0 && l <= l_max[lane] && l < lambda[lane];
+				
+				lambda[lane] = hit ? l : lambda[lane];
+				index[lane] = hit ? tri_index : index[lane];
+			}
+		}
+	};
+	
+	// Front-to-back traversal of a packet through the tree below node, as in the single ray node overload
+	template<typename N, typename Packet>
+	void trace_packet(const N& node, Packet& packet) {
+		using Num = typename N::Point::numeric_type;
+		using PairType = std::pair<Num, size_t>;
+		
+		constexpr size_t max_sorted = 64;
+		
+		struct StackEntry {
+			Num distance;
+			N node;
+		};
+		
+		TraversalStack<StackEntry, 256> stack;
+		
+		auto visit = [&](const N& current) {
+			for(size_t i = 0; i < current.n_data(); ++i)
+				packet.intersect_triangle(current.data(i));
+			
+			const size_t n_children = current.n_children();
+			PairType hits[max_sorted];
+			size_t n_hits = 0;
+			
+			for(size_t i = 0; i < n_children; ++i) {
+				const N child = current.child(i);
+				const Num distance = packet.intersect_box(child.bounding_box());
+				
+				if(!(distance < std::numeric_limits<Num>::infinity()))
+					continue;
+				
+				if(n_children <= max_sorted)
+					hits[n_hits++] = PairType(distance, i);
+				else
+					stack.push(StackEntry{distance, child});
+			}
+			
+			sort_descending(hits, n_hits);
+			for(size_t i = 0; i < n_hits; ++i)
+				stack.push(StackEntry{hits[i].first, current.child(hits[i].second)});
+		};
+		
+		visit(node);
+		
+		while(!stack.empty()) {
+			const StackEntry entry = stack.pop();
+			
+			// Skip nodes that no lane can find a closer hit in anymore
+			if(!(entry.distance <= packet.limit()))
+				continue;
+			
+			visit(entry.node);
+		}
+	}
+	
+	// Permutation of the batch in ray_order_key order
+	template<typename B, typename Num>
+	std::vector<size_t> morton_ray_order(const RayBatch<Num>& batch, const B& box) {
+		using P = point_for<typename B::Point>;
+		
+		std::vector<std::uint64_t> keys(batch.size());
+		parallel::parallel_for(0, batch.size(), [&](size_t i) {
+			P origin;
+			P direction;
+			
+			for(size_t d = 0; d < 3; ++d) {
+				origin[d] = batch.origin[d][i];
+				direction[d] = batch.direction[d][i];
+			}
+			
+			keys[i] = ray_order_key(origin, direction, box);
+		}, 4096);
+		
+		return sort_order(keys);
+	}
+}
+
+/** Traces all segments of the batch through the tree below node and stores the closest hits in
+ *  batch.lambda and batch.index. Consecutive segments are traced together in packets of the given width,
+ *  which pays off when they are coherent (similar origins and directions). Batches in arbitrary order
+ *  should use RayOrder::morton, which groups nearby segments into packets at the cost of a sort. Packets
+ *  are distributed over the threads of parallel_for. */
+template<size_t width = 8, typename N>
+std::enable_if_t<N::tag == tags::node> trace_batch(const N& node, RayBatch<typename N::Point::numeric_type>& batch, RayOrder order = RayOrder::keep) {
+	using Num = typename N::Point::numeric_type;
+	static_assert(N::Point::dimension == 3, "Batch tracing requires 3D meshes");
+	
+	std::vector<size_t> ids;
+	if(order == RayOrder::morton)
+		ids = internal::morton_ray_order(batch, node.bounding_box());
+	
+	const size_t* ids_data = ids.empty() ? nullptr : ids.data();
+	const size_t n_packets = (batch.size() + width - 1) / width;
+	
+	parallel::parallel_for(0, n_packets, [&](size_t i) {
+		internal::RayPacket<Num, width> packet;
+		packet.load(batch, i * width, ids_data);
+		
+		internal::trace_packet(node, packet);
+		
+		packet.store(batch, i * width, ids_data);
+	}, 16);
+}
+
+/** Traces the batch through the tree of a mesh */
+template<size_t width = 8, typename Mesh>
+auto trace_batch(Mesh& mesh, RayBatch<typename Mesh::Point::numeric_type>& batch, RayOrder order = RayOrder::keep) -> decltype(mesh.root(), void()) {
+	trace_batch<width>(mesh.root(), batch, order);
+}
+
+}
@@ -56,8 +56,6 @@ static Box<point_for<typename B1::Point>> combine_boxes(const B1& box1, const Re
 
 template<typename B>
 point_for<typename B::Point> center(const B& b) {
-	using RT = std::enable_if_t<concepts::implements<B, tags::box>::value, point_for<typename B::Point>>;
-	
 	return half_point(b.min(), b.max());
 }
 
@@ -70,4 +68,27 @@ bool is_empty(const B& b) {
 	return false;
 }
 
+/** Half of the surface area of a box (half the perimeter in 2D). This is the measure that determines how
+ *  likely a random ray is to hit the box. Empty boxes have zero area. */
+template<typename B>
+typename B::Point::numeric_type half_area(const B& b) {
+	using Num = typename B::Point::numeric_type;
+	constexpr size_t dim = B::Point::dimension;
+	
+	if(is_empty(b))
+		return 0;
+	
+	Num result = 0;
+	for(size_t i = 0; i < dim; ++i) {
+		Num face = 1;
+		for(size_t j = 0; j < dim; ++j) {
+			if(j != i)
+				face *= b.max()[j] - b.min()[j];
+		}
+		result += face;
+	}
+	
+	return result;
+}
+
 }
@@ -1,6 +1,16 @@
 #pragma once
 
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <iterator>
+#include <limits>
 #include <list>
+#include <memory>
+#include <numeric>
+#include <stdexcept>
+#include <type_traits>
 
 #include <tinygeo/pack.h>
 #include <tinygeo/triangle.h>
@@ -50,6 +60,14 @@ struct TriangleMesh {
 			return triangle_bounding_box(*this);
 		}
 		
+		// Cached intersection data, if enabled with TriangleMesh::precompute()
+		const PrecomputedTriangle<Point>* precomputed() const {
+			if(parent -> precomputed.size() != parent -> size())
+				return nullptr;
+			
+			return &(parent -> precomputed[index]);
+		}
+		
 		std::vector<tag_type> tags() const {
 			const size_t n_tags = parent -> tag_buffer.shape(1);
 			
@@ -96,18 +114,52 @@ struct TriangleMesh {
 	IndexBuffer index_buffer;
 	TagBuffer tag_buffer;
 	
-	size_t size() {
+	// Intersection data for every triangle in index buffer order, 9 numbers per triangle. Opt-in: filled by
+	// precompute() and from then on refreshed by pack() and refit(). In-place changes to the point or index
+	// buffers are not detected, precompute() must be called again after them.
+	std::vector<PrecomputedTriangle<Point>> precomputed;
+	
+	size_t size() const {
 		return index_buffer.shape(0);
 	}
 	
+	void precompute() {
+		precomputed.resize(size());
+		
+		parallel::parallel_for(0, size(), [this](size_t i) {
+			precomputed[i] = precompute_triangle((*this)[i]);
+		}, 1024);
+	}
+	
+	void clear_precomputed() {
+		precomputed.clear();
+		precomputed.shrink_to_fit();
+	}
+	
+	// Refreshes the cached intersection data if it is enabled
+	void update_precomputed() {
+		if(!precomputed.empty())
+			precompute();
+	}
+	
 	Iterator begin() { return Iterator(*this, 0); }
 	Iterator end() { return Iterator(*this, size()); }
 	
 	Accessor operator[](size_t i) {
 		return Accessor(this, i);
 	}
+	
+	// Tags of triangle i, e.g. for the index of a ray hit
+	std::vector<typename TagBuffer::Type> tags(size_t i) {
+		return Accessor(this, i).tags();
+	}
 };
 
+// Handle through which a mesh accesses its own tree. Node data that owns its storage and deep-copies it
+// (FlatNodeData) provides an overload returning a non-owning handle instead.
+template<typename NodeData>
+NodeData& tree_handle(NodeData& data) { return data; }
+
 // An extension of the TriangleMesh template that includes indexing by an R-Tree
 template<size_t dim, typename PointBuffer, typename IndexBuffer, typename TagBuffer, typename NodeData, typename GridData>
 struct IndexedTriangleMesh : public TriangleMesh<dim, PointBuffer, IndexBuffer, TagBuffer> {
@@ -125,8 +177,16 @@ struct IndexedTriangleMesh : public TriangleMesh<dim, PointBuffer, IndexBuffer,
 		static constexpr tags::tag tag = tags::node;
 		using tag_type = typename TagBuffer::Type;
 		
+		// Node data backends either hand out references to their children (SimpleNodeData) or lightweight
+		// handles (CapnpNodeData, FlatNodeData). The latter are temporaries and must be held by value.
+		using DataHolder = std::conditional_t<
+			std::is_reference<decltype(std::declval<const NodeData&>().child(0))>::value,
+			const NodeData&,
+			const NodeData
+		>;
+		
 		Self& mesh;
-		const NodeData& rdata;
+		DataHolder rdata;
 		
 		Node(Self& mesh, const NodeData& data) : mesh(mesh), rdata(data) {}
 		
@@ -135,7 +195,7 @@ struct IndexedTriangleMesh : public TriangleMesh<dim, PointBuffer, IndexBuffer,
 		size_t n_data() const { return rdata.range().second - rdata.range().first; }
 		Accessor data(size_t i) const { return Accessor(&mesh, rdata.range().first + i); }
 		
-		auto bounding_box() { return rdata.bounding_box(); }
+		auto bounding_box() const { return rdata.bounding_box(); }
 	};
 	
 	struct Grid {
@@ -158,13 +218,27 @@ struct IndexedTriangleMesh : public TriangleMesh<dim, PointBuffer, IndexBuffer,
 				size[d] = 1;
 		}
 		
-		auto bounding_box() const { return mesh.root().bounding_box(); }
+		// Copy of another mesh's grid, bound to this mesh
+		Grid(Self& mesh, const Grid& other) :
+			mesh(mesh), size(other.size), data(other.data), frame(other.frame), packed_size(other.packed_size), triangle_cells(other.triangle_cells)
+		{}
+		
+		Box<point_for<Point>> bounding_box() const {
+			if(is_empty(frame))
+				return mesh.root().bounding_box();
+			
+			return frame;
+		}
 		
 		MultiIndex index_for(const point_for<Point>& p) const {
+			return index_for(p, bounding_box());
+		}
+		
+		// Cell of p for the given grid bounds, avoids looking up the root box for every point
+		template<typename B>
+		MultiIndex index_for(const point_for<Point>& p, const B& bb) const {
 			using Num = typename Point::numeric_type;
 			
-			auto bb = bounding_box();
-			
 			point_for<Point> min = bb.min();
 			point_for<Point> max = bb.max();
 			
@@ -187,6 +261,11 @@ struct IndexedTriangleMesh : public TriangleMesh<dim, PointBuffer, IndexBuffer,
 			return result;
 		}
 		
+		// Indices of the triangles overlapping a cell
+		decltype(auto) cell(const MultiIndex& i) const {
+			return data.get(linear_index(i));
+		}
+		
 		std::list<Accessor> query(const MultiIndex i1, const MultiIndex i2) const {			
 			MultiIndex low;
 			MultiIndex high;
@@ -209,33 +288,323 @@ struct IndexedTriangleMesh : public TriangleMesh<dim, PointBuffer, IndexBuffer,
 			return result;
 		}
 	
-		void pack() {			
-			// Resize data structure
-			data.reset(linear_size());
+		void pack() {
+			frame = mesh.root().bounding_box();
+			packed_size = size;
+			
+			compute_cells(triangle_cells, frame, {});
+			fill_cells(data, triangle_cells);
+		}
+		
+		/** Brings the cells up to date after the vertices moved. The frame of the last pack() is kept as long
+		 *  as it contains the whole mesh, and only the entries of triangles that changed their cells are
+		 *  rewritten. If the mesh left the frame, the grid is repacked. */
+		void refit() {
+			const auto root_box = mesh.root().bounding_box();
+			
+			bool repack = data.size() != linear_size() || size != packed_size || triangle_cells.size() != mesh.size();
+			for(size_t d = 0; d < dimension; ++d) {
+				if(!(root_box.min()[d] >= frame.min()[d] && root_box.max()[d] <= frame.max()[d]))
+					repack = true;
+			}
+			
+			if(repack) {
+				pack();
+				return;
+			}
+			
+			std::vector<std::pair<size_t, size_t>> new_cells;
+			compute_cells(new_cells, frame, {});
 			
-			// Distribute triangles into ranges they intersect
-			for(Accessor acc : mesh) {
-				point_for<Point> p1 = acc.bounding_box().min();
-				point_for<Point> p2 = acc.bounding_box().max();
+			std::vector<uint32_t> moved;
+			for(size_t i = 0; i < new_cells.size(); ++i) {
+				if(new_cells[i] != triangle_cells[i])
+					moved.push_back((uint32_t) i);
+			}
+			
+			if(!moved.empty())
+				move_triangles(moved, new_cells);
+			
+			triangle_cells.swap(new_cells);
+		}
+		
+		/** Whether the cells are laid out over the current root box. This holds after pack(), but not
+		 *  necessarily after refit(), which keeps the old frame. */
+		bool root_framed() const {
+			return same_box(bounding_box(), mesh.root().bounding_box());
+		}
+		
+		/** Distributes the triangles into the cells of target, laid out over the root box. Triangle boxes are
+		 *  enlarged by padding, e.g. to cover the error of a lossy vertex encoding. */
+		template<typename Target>
+		void fill(Target& target, const std::array<typename Point::numeric_type, dimension>& padding = {}) const {
+			std::vector<std::pair<size_t, size_t>> cells;
+			compute_cells(cells, mesh.root().bounding_box(), padding);
+			
+			fill_cells(target, cells);
+		}
+	
+	private:
+		// Bounds the cells are laid out in. Set to the root box by pack() and kept by refit(). Grids that were
+		// never packed (e.g. loaded from a file) use the root box.
+		Box<point_for<Point>> frame = Box<point_for<Point>>::empty();
+		MultiIndex packed_size = {};
+		
+		// First and last cell (as linear indices) overlapped by every triangle, used by refit() to find the
+		// triangles that moved. Two indices per triangle.
+		std::vector<std::pair<size_t, size_t>> triangle_cells;
+		
+		static bool same_box(const Box<point_for<Point>>& b1, const Box<point_for<Point>>& b2) {
+			for(size_t d = 0; d < dimension; ++d) {
+				if(b1.min()[d] != b2.min()[d] || b1.max()[d] != b2.max()[d])
+					return false;
+			}
+			
+			return true;
+		}
+		
+		// Cell ranges of all triangles within the given grid bounds
+		template<typename B>
+		void compute_cells(std::vector<std::pair<size_t, size_t>>& cells, const B& grid_box, const std::array<typename Point::numeric_type, dimension>& padding) const {
+			const size_t n_triangles = mesh.size();
+			
+			if(n_triangles > std::numeric_limits<uint32_t>::max())
+				throw std::length_error("Grid supports at most 2^32 triangles");
+			
+			cells.resize(n_triangles);
+			
+			parallel::parallel_for(0, n_triangles, [&](size_t i) {
+				const auto range = cell_range(mesh[i], grid_box, padding);
+				cells[i] = std::make_pair(linear_index(range.first), linear_index(range.second));
+			}, 1024);
+		}
+		
+		// Calls f(cell) for all cells in the range
+		template<typename F>
+		void for_cells(const std::pair<size_t, size_t>& range, F&& f) const {
+			const MultiIndex low = multi_index(range.first);
+			const MultiIndex high = multi_index(range.second);
+			
+			MultiIndex c = low;
+			do {
+				f(linear_index(c));
+			} while(increment(c, low, high));
+		}
+		
+		/** Writes the triangles into the cells of target, given the cell range of every triangle.
+		 *
+		 *  The cells are computed in compressed-row form on all threads: a counting pass, a prefix sum over the
+		 *  cells and a scatter pass. Every cell is then sorted, so that the result does not depend on the
+		 *  thread count. */
+		template<typename Target>
+		void fill_cells(Target& target, const std::vector<std::pair<size_t, size_t>>& ranges) const {
+			const size_t n_cells = linear_size();
+			const size_t n_triangles = ranges.size();
+			
+			// Count the entries per cell
+			std::vector<std::atomic<uint32_t>> positions(n_cells);
+			
+			// A single thread can skip the locked increments and the sorting of the cells
+			const bool serial = parallel::num_threads() == 1;
+			
+			auto post_increment = [serial](std::atomic<uint32_t>& x) {
+				if(serial) {
+					const uint32_t result = x.load(std::memory_order_relaxed);
+					x.store(result + 1, std::memory_order_relaxed);
+					return result;
+				}
 				
-				MultiIndex i1 = index_for(p1);
-				MultiIndex i2 = index_for(p2);
+				return x.fetch_add(1, std::memory_order_relaxed);
+			};
+			
+			parallel::parallel_for(0, n_triangles, [&](size_t i) {
+				for_cells(ranges[i], [&](size_t cell) { post_increment(positions[cell]); });
+			}, 1024);
+			
+			// Prefix sum in blocks: block totals in parallel, a serial scan over the blocks, then the offsets
+			// within each block in parallel
+			std::vector<uint32_t> offsets(n_cells + 1);
+			
+			const size_t block_size = 1 << 16;
+			const size_t n_blocks = (n_cells + block_size - 1) / block_size;
+			
+			std::vector<size_t> block_start(n_blocks + 1);
+			parallel::parallel_for(0, n_blocks, [&](size_t b) {
+				size_t total = 0;
+				for(size_t c = b * block_size; c < std::min(n_cells, (b + 1) * block_size); ++c)
+					total += positions[c].load(std::memory_order_relaxed);
 				
-				MultiIndex low;
-				MultiIndex high;
-				for(size_t d = 0; d < dimension; ++d) {
-					low[d] = std::min(i1[d], i2[d]);
-					high[d] = std::max(i1[d], i2[d]);
+				block_start[b + 1] = total;
+			});
+			
+			for(size_t b = 0; b < n_blocks; ++b)
+				block_start[b + 1] += block_start[b];
+			
+			const size_t n_entries = block_start[n_blocks];
+			if(n_entries > std::numeric_limits<uint32_t>::max())
+				throw std::length_error("Grid has too many entries for 32bit offsets");
+			
+			parallel::parallel_for(0, n_blocks, [&](size_t b) {
+				uint32_t offset = (uint32_t) block_start[b];
+				
+				for(size_t c = b * block_size; c < std::min(n_cells, (b + 1) * block_size); ++c) {
+					const uint32_t count = positions[c].load(std::memory_order_relaxed);
+					
+					offsets[c] = offset;
+					positions[c].store(offset, std::memory_order_relaxed);
+					offset += count;
 				}
+			});
+			offsets[n_cells] = (uint32_t) n_entries;
+			
+			// Scatter the triangles into their cells
+			std::vector<uint32_t> indices(n_entries);
+			
+			parallel::parallel_for(0, n_triangles, [&](size_t i) {
+				for_cells(ranges[i], [&](size_t cell) { indices[post_increment(positions[cell])] = (uint32_t) i; });
+			}, 1024);
+			
+			// Threads may have interleaved within a cell. Restore the ascending order of the serial fill
+			if(!serial) {
+				parallel::parallel_for(0, n_cells, [&](size_t c) {
+					auto begin = indices.begin() + offsets[c];
+					auto end = indices.begin() + offsets[c + 1];
+					
+					if(!std::is_sorted(begin, end))
+						std::sort(begin, end);
+				}, 4096);
+			}
+			
+			store_cells(target, offsets, indices, 0);
+		}
+		
+		// Rewrites the cells after the given triangles (in ascending order) changed their cell ranges. The
+		// entries of all other triangles are copied over.
+		void move_triangles(const std::vector<uint32_t>& moved, const std::vector<std::pair<size_t, size_t>>& new_cells) {
+			const size_t n_cells = linear_size();
+			
+			std::vector<char> is_moved(mesh.size(), 0);
+			for(uint32_t i : moved)
+				is_moved[i] = 1;
+			
+			// New entries of the moved triangles, ordered by cell and triangle
+			std::vector<std::pair<size_t, uint32_t>> added;
+			for(uint32_t i : moved)
+				for_cells(new_cells[i], [&](size_t cell) { added.emplace_back(cell, i); });
+			
+			std::sort(added.begin(), added.end());
+			
+			std::vector<size_t> added_start(n_cells + 1);
+			for(const auto& entry : added)
+				++added_start[entry.first + 1];
+			
+			std::partial_sum(added_start.begin(), added_start.end(), added_start.begin());
+			
+			// Entries per cell after the update
+			std::vector<size_t> counts(n_cells);
+			parallel::parallel_for(0, n_cells, [&](size_t c) {
+				size_t count = added_start[c + 1] - added_start[c];
+				
+				for(size_t idx : data.get(c))
+					count += !is_moved[idx];
 				
-				MultiIndex c = low;
-				do {
-					data.insert(linear_index(c), acc.index);
-				} while(increment(c, low, high));
+				counts[c] = count;
+			}, 4096);
+			
+			std::vector<uint32_t> offsets(n_cells + 1);
+			size_t n_entries = 0;
+			for(size_t c = 0; c < n_cells; ++c) {
+				offsets[c] = (uint32_t) n_entries;
+				n_entries += counts[c];
+				
+				if(n_entries > std::numeric_limits<uint32_t>::max())
+					throw std::length_error("Grid has too many entries for 32bit offsets");
 			}
+			offsets[n_cells] = (uint32_t) n_entries;
+			
+			// Merge the remaining and the added entries, keeping every cell sorted
+			std::vector<uint32_t> indices(n_entries);
+			parallel::parallel_for(0, n_cells, [&](size_t c) {
+				uint32_t* out = indices.data() + offsets[c];
+				size_t next_added = added_start[c];
+				
+				for(size_t idx : data.get(c)) {
+					if(is_moved[idx])
+						continue;
+					
+					while(next_added < added_start[c + 1] && added[next_added].second < idx)
+						*(out++) = added[next_added++].second;
+					
+					*(out++) = (uint32_t) idx;
+				}
+				
+				while(next_added < added_start[c + 1])
+					*(out++) = added[next_added++].second;
+			}, 4096);
+			
+			store_cells(data, offsets, indices, 0);
 		}
-	
-	private:
+		
+		// Range of cells overlapped by the bounding box of a triangle, enlarged by padding
+		template<typename B>
+		std::pair<MultiIndex, MultiIndex> cell_range(const Accessor& acc, const B& grid_box, const std::array<typename Point::numeric_type, dimension>& padding) const {
+			const auto bb = acc.bounding_box();
+			
+			point_for<Point> p1 = bb.min();
+			point_for<Point> p2 = bb.max();
+			for(size_t d = 0; d < dimension; ++d) {
+				p1[d] -= padding[d];
+				p2[d] += padding[d];
+			}
+			
+			MultiIndex i1 = index_for(p1, grid_box);
+			MultiIndex i2 = index_for(p2, grid_box);
+			
+			MultiIndex low;
+			MultiIndex high;
+			for(size_t d = 0; d < dimension; ++d) {
+				low[d] = std::min(i1[d], i2[d]);
+				high[d] = std::max(i1[d], i2[d]);
+			}
+			
+			return std::make_pair(low, high);
+		}
+		
+		// Backends taking compressed rows directly get the arrays moved in. Others are filled entry by entry.
+		template<typename Target>
+		static auto store_cells(Target& target, std::vector<uint32_t>& offsets, std::vector<uint32_t>& indices, int) -> decltype(target.assign(std::move(offsets), std::move(indices))) {
+			return target.assign(std::move(offsets), std::move(indices));
+		}
+		
+		template<typename Target>
+		static void store_cells(Target& target, std::vector<uint32_t>& offsets, std::vector<uint32_t>& indices, long) {
+			const size_t n_cells = offsets.size() - 1;
+			target.reset(n_cells);
+			
+			for(size_t c = 0; c < n_cells; ++c) {
+				for(uint32_t k = offsets[c]; k < offsets[c + 1]; ++k)
+					target.count(c);
+			}
+			
+			target.allocate();
+			
+			for(size_t c = 0; c < n_cells; ++c) {
+				for(uint32_t k = offsets[c]; k < offsets[c + 1]; ++k)
+					target.insert(c, indices[k]);
+			}
+		}
+		
+		MultiIndex multi_index(size_t linear) const {
+			MultiIndex result;
+			
+			for(size_t d = dimension; d-- > 0; ) {
+				result[d] = linear % size[d];
+				linear /= size[d];
+			}
+			
+			return result;
+		}
+		
 		size_t linear_index(const MultiIndex i) const {
 			size_t result = 0;
 			
@@ -270,75 +639,396 @@ struct IndexedTriangleMesh : public TriangleMesh<dim, PointBuffer, IndexBuffer,
 		}
 	};
 	
+	/** A collapsed copy of the packed tree in which every node holds up to 'width' children. The child boxes
+	 *  are stored as structure-of-arrays, so that a ray can be tested against all children of a node in one
+	 *  vectorizable pass. */
+	template<size_t width>
+	struct Wide {
+		using Point = typename Parent::Point;
+		using Num = typename Point::numeric_type;
+		static constexpr tags::tag tag = tags::wide;
+		using tag_type = typename TagBuffer::Type;
+		
+		static constexpr size_t lanes = width;
+		
+		struct Entry {
+			// Unused lanes have min = max = +inf, which no ray can hit
+			Num min[dimension][width];
+			Num max[dimension][width];
+			
+			// Inner children refer to another entry, leaf children to a triangle range
+			uint32_t child[width];
+			uint32_t count[width];
+		};
+		
+		Self& mesh;
+		std::vector<Entry> nodes;
+		
+		Wide(Self& mesh) : mesh(mesh) {}
+		Wide(Self& mesh, const Wide& other) : mesh(mesh), nodes(other.nodes) {}
+		
+		bool empty() const { return nodes.empty(); }
+		
+		void clear() {
+			nodes.clear();
+			nodes.shrink_to_fit();
+		}
+		
+		void pack() {
+			nodes.clear();
+			
+			Item root = convert(mesh.root());
+			limit_fanout(root);
+			
+			if(root.children.empty()) {
+				// Unpacked mesh. Wrap the triangles into a single leaf lane
+				if(root.count > 0) {
+					Item wrapper;
+					wrapper.box = root.box;
+					wrapper.children.push_back(root);
+					emit(wrapper);
+				}
+			} else {
+				emit(root);
+			}
+		}
+		
+	private:
+		using B = Box<point_for<Point>>;
+		
+		// Intermediate tree used during collapsing
+		struct Item {
+			B box;
+			size_t start = 0;
+			size_t count = 0;
+			std::vector<Item> children;
+		};
+		
+		static Item convert(const Node& node) {
+			Item result;
+			result.box = node.bounding_box();
+			
+			const size_t n_data = node.n_data();
+			const size_t start = n_data > 0 ? node.data(0).index : 0;
+			
+			if(node.n_children() == 0) {
+				result.start = start;
+				result.count = n_data;
+				return result;
+			}
+			
+			// Data held by an interior node becomes an additional leaf child
+			if(n_data > 0) {
+				Item leaf;
+				leaf.box = B::empty();
+				for(size_t i = 0; i < n_data; ++i)
+					leaf.box = combine_boxes(leaf.box, node.data(i).bounding_box());
+				
+				leaf.start = start;
+				leaf.count = n_data;
+				result.children.push_back(leaf);
+			}
+			
+			for(size_t i = 0; i < node.n_children(); ++i) {
+				Item child = convert(node.child(i));
+				
+				if(child.count > 0 || !child.children.empty())
+					result.children.push_back(std::move(child));
+			}
+			
+			return result;
+		}
+		
+		// Splits the children of nodes with too many children into contiguous groups
+		static void limit_fanout(Item& item) {
+			for(Item& child : item.children)
+				limit_fanout(child);
+			
+			const size_t n = item.children.size();
+			if(n <= width)
+				return;
+			
+			std::vector<Item> groups(width);
+			const size_t per_group = n / width;
+			const size_t remain = n - per_group * width;
+			
+			auto it = item.children.begin();
+			for(size_t i = 0; i < width; ++i) {
+				const size_t count = i < remain ? per_group + 1 : per_group;
+				
+				Item& group = groups[i];
+				group.box = B::empty();
+				for(size_t j = 0; j < count; ++j, ++it) {
+					group.box = combine_boxes(group.box, it -> box);
+					group.children.push_back(std::move(*it));
+				}
+				
+				limit_fanout(group);
+			}
+			
+			item.children = std::move(groups);
+		}
+		
+		// Writes the entry for an inner item and returns its index
+		uint32_t emit(const Item& item) {
+			std::vector<const Item*> slots;
+			for(const Item& child : item.children)
+				slots.push_back(&child);
+			
+			// Pull up the children of the largest inner slots as long as they fit
+			while(true) {
+				size_t best = slots.size();
+				Num best_area = -1;
+				
+				for(size_t i = 0; i < slots.size(); ++i) {
+					const Item& slot = *slots[i];
+					
+					if(slot.children.empty() || slots.size() - 1 + slot.children.size() > width)
+						continue;
+					
+					const Num area = half_area(slot.box);
+					if(area > best_area) {
+						best = i;
+						best_area = area;
+					}
+				}
+				
+				if(best == slots.size())
+					break;
+				
+				const Item& expanded = *slots[best];
+				slots.erase(slots.begin() + best);
+				
+				for(size_t i = 0; i < expanded.children.size(); ++i)
+					slots.insert(slots.begin() + best + i, &expanded.children[i]);
+			}
+			
+			const uint32_t index = nodes.size();
+			nodes.emplace_back();
+			
+			const Num inf = std::numeric_limits<Num>::infinity();
+			
+			for(size_t lane = 0; lane < width; ++lane) {
+				uint32_t child = 0;
+				uint32_t count = 0;
+				B box = B::empty();
+				
+				if(lane < slots.size()) {
+					const Item& slot = *slots[lane];
+					box = slot.box;
+					
+					if(slot.children.empty()) {
+						child = slot.start;
+						count = slot.count;
+					} else {
+						// Note: This may reallocate 'nodes'
+						child = emit(slot);
+					}
+				}
+				
+				Entry& entry = nodes[index];
+				entry.child[lane] = child;
+				entry.count[lane] = count;
+				
+				const bool unused = is_empty(box);
+				for(size_t d = 0; d < dimension; ++d) {
+					entry.min[d][lane] = unused ? inf : box.min()[d];
+					entry.max[d][lane] = unused ? inf : box.max()[d];
+				}
+			}
+			
+			return index;
+		}
+	};
+	
 	IndexedTriangleMesh(const PointBuffer& point_buffer, const IndexBuffer& index_buffer, const TagBuffer& tag_buffer, const NodeData& root_data, const GridData& grid_data) :
 		Parent(point_buffer, index_buffer, tag_buffer),
 		root_data(root_data),
-		grid(*this, grid_data)
+		grid(*this, grid_data),
+		wide4(*this),
+		wide8(*this)
 	{
 		if(index_buffer.shape(0) != tag_buffer.shape(0))
 			throw std::invalid_argument("Index and tag buffer must have identical first dimension");
 	}
 	
+	// Copies are independent of the original: they hold their own tree, and grid and wide trees refer to the copy
+	IndexedTriangleMesh(const IndexedTriangleMesh& other) :
+		Parent(other),
+		root_data(other.root_data),
+		grid(*this, other.grid),
+		wide4(*this, other.wide4),
+		wide8(*this, other.wide8)
+	{}
+	
 	NodeData root_data;
 	Grid grid;
 	
+	// Collapsed 4- and 8-wide trees. Empty unless built with build_wide
+	Wide<4> wide4;
+	Wide<8> wide8;
+	
 	Node root() {
-		return Node(*this, root_data);
+		return Node(*this, tree_handle(root_data));
 	}
 	
-	void pack(size_t size) {
+	void pack(size_t size, PackStrategy strategy = PackStrategy::str) {
 		// Pack up the data contained in this node
-		Node r = root();
-		
 		using PackNode = tinygeo::PackNode<Accessor>;
-		PackNode pack_result = tinygeo::pack(this -> begin(), this -> end(), size);
+		PackNode pack_result;
+		switch(strategy) {
+			case PackStrategy::str:  pack_result = tinygeo::pack(this -> begin(), this -> end(), size); break;
+			case PackStrategy::sah:  pack_result = tinygeo::pack_sah(this -> begin(), this -> end(), size); break;
+			case PackStrategy::lbvh: pack_result = tinygeo::pack_lbvh(this -> begin(), this -> end(), size); break;
+		}
 		
 		// Allocate new index and tag buffer
 		IndexBuffer new_buffer    (this -> index_buffer.shape(0), 3);
 		TagBuffer   new_tag_buffer(this -> tag_buffer.shape(0)  , this -> tag_buffer.shape(1));
 		size_t counter = 0;
 		
-		// Insert all nodes into the queue
-		std::list<std::pair<PackNode, std::reference_wrapper<NodeData>>> queue;
+		// Write the tree depth-first, so that the triangles of every sub-tree end up in a contiguous range
+		NodeData new_root;
+		pack_node(pack_result, new_root, new_buffer, new_tag_buffer, counter);
+		
+		root_data = std::move(new_root);
+		this -> index_buffer = new_buffer;
+		this -> tag_buffer   = new_tag_buffer;
+		
+		// Store the intersection data in the new (leaf) order
+		this -> update_precomputed();
+		
+		grid.pack();
+		
+		if(!wide4.empty()) wide4.pack();
+		if(!wide8.empty()) wide8.pack();
+	}
+	
+	/** Updates the mesh after its vertices moved without repacking it. The tree keeps its topology and the
+	 *  triangles their order, only the node bounding boxes are recomputed bottom-up. The grid keeps its
+	 *  frame and only updates the triangles that moved between cells, see Grid::refit(). */
+	void refit() {
+		this -> update_precomputed();
+		
+		refit_tree();
+		grid.refit();
+		
+		if(!wide4.empty()) wide4.pack();
+		if(!wide8.empty()) wide8.pack();
+	}
+	
+	/** Builds the collapsed tree of the given width (4 or 8) from the current tree and drops the one of the
+	 *  other width. It is rebuilt by subsequent calls to pack. */
+	void build_wide(size_t width) {
+		switch(width) {
+			case 4: wide8.clear(); wide4.pack(); return;
+			case 8: wide4.clear(); wide8.pack(); return;
+		}
+		
+		throw std::invalid_argument("Wide tree width must be 4 or 8");
+	}
+	
+	double sah_cost(SAHCosts costs = SAHCosts()) {
+		return tinygeo::sah_cost(root(), costs);
+	}
+
+private:
+	// Recomputes the box of a node from its triangles and the (already refit) boxes of its children
+	template<typename Data>
+	void fit_node(Data& data) {
+		auto box = Box<point_for<Point>>::empty();
+		
+		for(size_t i = data.range().first; i < data.range().second; ++i)
+			box = combine_boxes(box, (*this)[i].bounding_box());
+		
+		for(size_t i = 0; i < data.n_children(); ++i)
+			box = combine_boxes(box, data.child(i).bounding_box());
+		
+		data.bounding_box() = box;
+	}
+	
+	template<typename Data>
+	void refit_node(Data& data) {
+		for(size_t i = 0; i < data.n_children(); ++i) {
+			auto&& child = data.child(i);
+			refit_node(child);
+		}
+		
+		fit_node(data);
+	}
+	
+	void refit_tree() {
+		// Handles to nodes in the tree, see Node::DataHolder
+		using Handle = std::conditional_t<
+			std::is_reference<decltype(root_data.child(0))>::value,
+			std::reference_wrapper<NodeData>,
+			NodeData
+		>;
+		
+		// Split the upper levels into enough sub-trees to keep all threads busy. Leaves are carried over to the
+		// next level, so the last level holds the roots of all sub-trees.
+		const size_t n_subtrees = 4 * parallel::num_threads();
+		
+		std::vector<Handle> upper;
+		std::vector<Handle> level(1, Handle(tree_handle(root_data)));
+		
+		while(level.size() < n_subtrees) {
+			std::vector<Handle> next;
+			
+			for(Handle& handle : level) {
+				NodeData& data = handle;
 				
-		auto process = [&,this](const PackNode& in, NodeData& out) {
-			const size_t count = in.data.size();
-			
-			// Set allocated range in node data
-			out.set_start(counter);
-			out.set_end(counter + count);
-			out.bounding_box() = in.box;
-			
-			// Copy indices into allocated range
-			for(size_t i = 0; i < count; ++i) {
-				for(size_t j = 0; j < 3; ++j) {
-					new_buffer(counter + i, j) = this -> index_buffer(in.data[i].index, j);
+				if(data.n_children() == 0) {
+					next.push_back(handle);
+					continue;
 				}
 				
-				for(size_t j = 0; j < this -> tag_buffer.shape(1); ++j) {
-					new_tag_buffer(counter + i, j) = this -> tag_buffer(in.data[i].index, j);
-				}
+				upper.push_back(handle);
+				for(size_t i = 0; i < data.n_children(); ++i)
+					next.push_back(Handle(data.child(i)));
 			}
-			counter += count;
 			
-			// Add children to queue
-			const size_t n_c = in.children.size();
-			out.init_children(n_c);
-			for(size_t i = 0; i < n_c; ++i)
-				queue.push_back(std::make_pair(in.children[i], std::ref(out.child(i))));
-		};
-		
-		queue.push_back(std::make_pair(pack_result, std::ref(root_data)));
-		for(auto it = queue.begin(); it != queue.end(); ++it) {
-			const PackNode& in = it -> first;
-			NodeData& out = it -> second;
-			process(in, out);
+			if(next.size() == level.size())
+				break;
+			
+			level = std::move(next);
 		}
 		
-		this -> index_buffer = new_buffer;
-		this -> tag_buffer   = new_tag_buffer;
+		parallel::parallel_for(0, level.size(), [&](size_t i) {
+			refit_node(static_cast<NodeData&>(level[i]));
+		});
 		
-		grid.pack();
+		// Parents were recorded before their children
+		for(size_t i = upper.size(); i > 0; --i)
+			fit_node(static_cast<NodeData&>(upper[i - 1]));
+	}
+	
+	template<typename PackNode, typename Out>
+	void pack_node(const PackNode& in, Out&& out, IndexBuffer& new_buffer, TagBuffer& new_tag_buffer, size_t& counter) {
+		const size_t count = in.data.size();
+		
+		// Set allocated range in node data
+		out.set_start(counter);
+		out.set_end(counter + count);
+		out.bounding_box() = in.box;
+		
+		// Copy indices into allocated range
+		for(size_t i = 0; i < count; ++i) {
+			for(size_t j = 0; j < 3; ++j) {
+				new_buffer(counter + i, j) = this -> index_buffer(in.data[i].index, j);
+			}
+			
+			for(size_t j = 0; j < this -> tag_buffer.shape(1); ++j) {
+				new_tag_buffer(counter + i, j) = this -> tag_buffer(in.data[i].index, j);
+			}
+		}
+		counter += count;
+		
+		// Process children
+		const size_t n_c = in.children.size();
+		out.init_children(n_c);
+		for(size_t i = 0; i < n_c; ++i)
+			pack_node(in.children[i], out.child(i), new_buffer, new_tag_buffer, counter);
 	}
 };
 
@@ -368,6 +1058,96 @@ private:
 	Box<P> bb;
 };
 
+/** Node storage that keeps the whole tree in one contiguous array instead of a separate heap block per node.
+ *  Nodes are laid out in depth-first order, with the children of every node stored next to each other, so
+ *  each entry only needs the offset of its first child and its triangle range.
+ *
+ *  The root handle owns the storage, and copying it copies the whole tree. Handles returned by child() do not
+ *  own the storage, copy shallowly and must not outlive the root handle. Use shared_child() if the handle needs
+ *  to stay valid on its own, its copies share the storage. */
+template<typename P>
+struct FlatNodeData {
+	struct Entry {
+		Box<P> bb;
+		
+		// 32 bit offsets, matching the width of the capnp format
+		uint32_t start;
+		uint32_t end;
+		uint32_t first_child;
+		uint32_t n_children;
+		
+		Entry() : bb(Box<P>::empty()), start(0), end(0), first_child(0), n_children(0) {}
+	};
+	
+	using Storage = std::vector<Entry>;
+	
+	std::pair<size_t, size_t> range() const { return std::make_pair(entry().start, entry().end); }
+	void set_start(size_t val) { entry().start = narrow(val); }
+	void set_end(size_t val) { entry().end = narrow(val); }
+	
+	void init_children(size_t s) {
+		const size_t first = nodes -> size();
+		
+		entry().first_child = narrow(first);
+		entry().n_children = narrow(s);
+		
+		// Note: This invalidates references to entries, but not handles
+		nodes -> resize(first + s);
+	}
+	
+	size_t n_children() const { return entry().n_children; }
+	FlatNodeData child(size_t i) const { return FlatNodeData(nodes, entry().first_child + i); }
+	
+	FlatNodeData shared_child(size_t i) const {
+		FlatNodeData result = child(i);
+		result.owner = owner;
+		return result;
+	}
+	
+	const Box<P>& bounding_box() const { return entry().bb; }
+	Box<P>& bounding_box() { return entry().bb; }
+	
+	FlatNodeData() : owner(std::make_shared<Storage>(1)), nodes(owner.get()), index(0) {}
+	
+	FlatNodeData(const FlatNodeData& other) : owner(other.owner), nodes(other.nodes), index(other.index) {
+		if(other.owns_tree()) {
+			owner = std::make_shared<Storage>(*other.nodes);
+			nodes = owner.get();
+		}
+	}
+	
+	FlatNodeData& operator=(const FlatNodeData& other) {
+		FlatNodeData copy(other);
+		return *this = std::move(copy);
+	}
+	
+	FlatNodeData(FlatNodeData&&) = default;
+	FlatNodeData& operator=(FlatNodeData&&) = default;
+	
+	// Non-owning handle to the root, so that Node does not copy the tree
+	friend FlatNodeData tree_handle(FlatNodeData& data) { return FlatNodeData(data.nodes, data.index); }
+	
+private:
+	FlatNodeData(Storage* nodes, size_t index) : owner(), nodes(nodes), index(index) {}
+	
+	// Root handles own the tree, shared_child() handles only keep it alive
+	bool owns_tree() const { return owner && index == 0; }
+	
+	const Entry& entry() const { return (*nodes)[index]; }
+	Entry& entry() { return (*nodes)[index]; }
+	
+	static uint32_t narrow(size_t val) {
+		if(val > std::numeric_limits<uint32_t>::max())
+			throw std::length_error("FlatNodeData supports at most 2^32 triangles and nodes");
+		
+		return (uint32_t) val;
+	}
+	
+	std::shared_ptr<Storage> owner;
+	Storage* nodes;
+	size_t index;
+};
+
 struct SimpleGridData {
 	std::vector<std::list<size_t>> data;
 	
@@ -387,9 +1167,76 @@ struct SimpleGridData {
 		data.resize(n);
 	}
 	
+	// Lists grow on insertion, so no sizes need to be reserved
+	void count(size_t) {}
+	void allocate() {}
+	
 	void insert(size_t i, size_t val) {
 		data[i].push_back(val);
 	}
 };
 
+/** Grid data in compressed-row form: the triangles of cell i are indices[offsets[i]] to indices[offsets[i+1]].
+ *  Filled in two passes: count() for every entry, then allocate(), then insert() for the same entries. */
+struct CSRGridData {
+	struct Range {
+		const uint32_t* first;
+		const uint32_t* last;
+		
+		const uint32_t* begin() const { return first; }
+		const uint32_t* end() const { return last; }
+		size_t size() const { return last - first; }
+	};
+	
+	std::vector<uint32_t> offsets;
+	std::vector<uint32_t> indices;
+	
+	Range get(size_t i) const {
+		if(offsets.size() == 0)
+			throw std::logic_error("query called on unitialized grid data");
+		
+		return Range{indices.data() + offsets[i], indices.data() + offsets[i + 1]};
+	}
+	
+	size_t size() const {
+		return offsets.size() == 0 ? 0 : offsets.size() - 1;
+	}
+	
+	void reset(size_t n) {
+		offsets.assign(n + 1, 0);
+		indices.clear();
+	}
+	
+	void count(size_t i) {
+		++offsets[i + 1];
+	}
+	
+	// Turns the counts into start positions. Until all entries are inserted, offsets[i + 1] serves
+	// as the fill position of cell i and ends up at its end.
+	void allocate() {
+		size_t total = 0;
+		
+		for(size_t i = 1; i < offsets.size(); ++i) {
+			const size_t n = offsets[i];
+			offsets[i] = total;
+			total += n;
+		}
+		
+		if(total > std::numeric_limits<uint32_t>::max())
+			throw std::length_error("Grid has too many entries for 32bit offsets");
+		
+		indices.resize(total);
+	}
+	
+	void insert(size_t i, size_t val) {
+		indices[offsets[i + 1]++] = val;
+	}
+	
+	// Takes over complete arrays, as computed by the parallel fill of the mesh grid
+	void assign(std::vector<uint32_t>&& new_offsets, std::vector<uint32_t>&& new_indices) {
+		offsets = std::move(new_offsets);
+		indices = std::move(new_indices);
+	}
+};
+
 }
@@ -1,12 +1,19 @@
 #pragma once
 
+#include <array>
+#include <cmath>
+#include <cstring>
+#include <fstream>
+#include <functional>
 #include <list>
 
 #include <tinygeo/pack.h>
 #include <tinygeo/triangle.h>
 #include <tinygeo/point.h>
+#include <tinygeo/parallel.h>
 
 #include <capnp/serialize.h>
+#include <capnp/serialize-packed.h>
 
 // POSIX-style file-handling
 #if _WIN32
@@ -14,6 +21,8 @@
 #else
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
+#include <unistd.h>
 #include <fcntl.h>
 #endif
 
@@ -23,22 +32,97 @@
 #include <iostream>
 
 namespace tinygeo {
+
+/** How CapnpTriangleMesh::load reads a file. 'stream' copies the message into heap segments. 'mmap' maps
+ *  the file read-only and reads the message in place, so opening is independent of the file size and the
+ *  pages are shared with other processes through the page cache. Windows builds stream instead. 'packed'
+ *  decodes files saved with SaveOptions::packed into heap segments. It is the only mode that reads them. */
+enum class LoadMode { stream, mmap, packed };
+
+#if _WIN32
+constexpr LoadMode default_load_mode = LoadMode::stream;
+#else
+constexpr LoadMode default_load_mode = LoadMode::mmap;
+#endif
+
+/** Storage of vertex coordinates in version 2 and 3 files. float32 and quantized16 (relative to the bounding
+ *  box of the root node) are lossy. Saved node boxes and grid cells are enlarged to cover the error, and
+ *  decoded vertices are clamped to the root box, so that ray casts stay consistent with the decoded mesh. */
+enum class VertexEncoding { float64, float32, quantized16 };
+
+/** Options for capnp::save_file. Packed files are smaller but are decoded on load and can not be mapped. They
+ *  have to be loaded with LoadMode::packed.
+ *
+ *  Readers from before the version field was introduced only understand version 0. They reject version 3
+ *  files (the default) with a dimension mismatch, but read versions 1 and 2 as empty meshes. save_file
+ *  therefore only writes versions 1 and 2 if legacy is set. */
+struct SaveOptions {
+	uint32_t version = 3;
+	bool packed = false;
+	bool legacy = false;
+	VertexEncoding vertices = VertexEncoding::float64;
+};
 	
+namespace internal {
+	// Raw arrays in version 2 and 3 files are little endian, which is the native layout on all supported hosts
+	inline void check_byte_order() {
+		const uint16_t probe = 1;
+		
+		if(*reinterpret_cast<const uint8_t*>(&probe) != 1)
+			throw std::logic_error("Raw capnp arrays are only supported on little-endian hosts");
+	}
+	
+	// Checks whether a file holds exactly one unpacked message by comparing its segment table with the
+	// file size. Files written with packed encoding fail this check.
+	inline bool is_unpacked_message(const std::string& filename) {
+		std::ifstream in(filename, std::ios::binary | std::ios::ate);
+		if(!in)
+			return false;
+		
+		const uint64_t file_size = in.tellg();
+		in.seekg(0);
+		
+		uint32_t n_segments = 0;
+		if(!in.read(reinterpret_cast<char*>(&n_segments), 4))
+			return false;
+		
+		// Cap'n'proto limits messages to 512 segments
+		++n_segments;
+		if(n_segments > 512)
+			return false;
+		
+		uint64_t total = 4 * (1 + n_segments);
+		total += total % 8;
+		
+		for(uint32_t i = 0; i < n_segments; ++i) {
+			uint32_t size = 0;
+			if(!in.read(reinterpret_cast<char*>(&size), 4))
+				return false;
+			
+			total += 8 * (uint64_t) size;
+		}
+		
+		return total == file_size;
+	}
+}
+
+/** 2D view of a capnp list (version 0 and 1 files) or of a chunked GeoArray (version 2 and 3 files).
+ *  Chunked arrays are read in place from the message. */
 template<typename T>
 struct CapnpBufferReader {
 	using Type = T;
 	using Backend = typename ::capnp::List<T>::Reader;
 	
 	struct Ref {
-		Backend& target;
+		const CapnpBufferReader* target;
 		size_t idx;
 		
-		Ref(Backend& target, size_t idx) :
+		Ref(const CapnpBufferReader* target, size_t idx) :
 			target(target), idx(idx)
 		{}
 		
 		operator T() const {
-			return target[idx];
+			return target -> get(idx);
 		}
 		
 		void operator=(const Type& other) {
@@ -49,6 +133,11 @@ struct CapnpBufferReader {
 	Backend backend;
 	std::array<size_t, 2> myshape;
 	
+	// Chunk i holds the elements [i << chunk_bits, (i + 1) << chunk_bits)
+	std::vector<const T*> chunks;
+	size_t chunk_bits = 0;
+	bool chunked = false;
+	
 	CapnpBufferReader(const Backend backend, std::array<size_t, 2> shape) :
 		backend(backend), myshape(shape)
 	{
@@ -56,9 +145,57 @@ struct CapnpBufferReader {
 			throw std::invalid_argument("Shape product must be equal to buffer size");
 	}
 	
-	Ref operator()(size_t i, size_t j) {
+	// View of contiguous memory owned elsewhere
+	CapnpBufferReader(const T* data, std::array<size_t, 2> shape) :
+		myshape(shape), chunks(1, data), chunk_bits(std::numeric_limits<size_t>::digits - 1), chunked(true)
+	{}
+	
+	CapnpBufferReader(capnp::GeoArray::Reader array, std::array<size_t, 2> shape) :
+		myshape(shape), chunked(true)
+	{
+		internal::check_byte_order();
+		
+		const uint64_t size = array.getSize();
+		const uint64_t chunk_size = array.getChunkSize();
+		
+		if(shape[0] * shape[1] != size)
+			throw std::invalid_argument("Shape product must be equal to buffer size");
+		
+		if(chunk_size == 0 || (chunk_size & (chunk_size - 1)) != 0)
+			throw std::invalid_argument("Array chunk size must be a power of 2");
+		
+		while(((uint64_t) 1 << chunk_bits) < chunk_size)
+			++chunk_bits;
+		
+		auto data = array.getChunks();
+		if(data.size() != (size + chunk_size - 1) / chunk_size)
+			throw std::invalid_argument("Array has wrong number of chunks");
+		
+		chunks.reserve(data.size());
+		for(size_t i = 0; i < data.size(); ++i) {
+			auto bytes = data[i];
+			const uint64_t n = std::min(chunk_size, size - i * chunk_size);
+			
+			if(bytes.size() != n * sizeof(T))
+				throw std::invalid_argument("Array chunk has wrong size");
+			
+			if(reinterpret_cast<uintptr_t>(bytes.begin()) % alignof(T) != 0)
+				throw std::invalid_argument("Array chunk is not aligned");
+			
+			chunks.push_back(reinterpret_cast<const T*>(bytes.begin()));
+		}
+	}
+	
+	T get(size_t li) const {
+		if(chunked)
+			return chunks[li >> chunk_bits][li & (((size_t) 1 << chunk_bits) - 1)];
+		
+		return backend[li];
+	}
+	
+	Ref operator()(size_t i, size_t j) const {
 		size_t li = shape(1) * i + j;
-		return Ref(backend, li);
+		return Ref(this, li);
 	}
 	
 	size_t shape(size_t d) const {
@@ -69,27 +206,69 @@ struct CapnpBufferReader {
 	}
 };
 	
+// Version 0 files store the tree as nested GeoNode structs, version 1 files as a flat GeoFlatNode table
 template<typename P>
 struct CapnpNodeData {
+	using FlatList = ::capnp::List<capnp::GeoFlatNode>;
+	
 	capnp::GeoNode::Reader backend;
 	
+	FlatList::Reader flat;
+	uint32_t index = 0;
+	bool is_flat = false;
+	
 	CapnpNodeData(const capnp::GeoNode::Reader& backend) :
 		backend(backend)
 	{}
 	
+	CapnpNodeData(const FlatList::Reader& flat, uint32_t index) :
+		flat(flat), index(index), is_flat(true)
+	{}
+	
 	CapnpNodeData() {}
 	
-	std::pair<size_t, size_t> range() const { return std::make_pair(backend.getBegin(), backend.getEnd()); }
+	std::pair<size_t, size_t> range() const {
+		if(is_flat)
+			return std::make_pair(flat[index].getBegin(), flat[index].getEnd());
+		
+		return std::make_pair(backend.getBegin(), backend.getEnd());
+	}
+	
 	void set_start(size_t val) { throw std::logic_error("Cannot set start on Capnp node data"); }
 	void set_end(size_t val) {  throw std::logic_error("Cannot set end on Capnp node data"); }
 	
 	void init_children(size_t s) {  throw std::logic_error("Cannot set children on Capnp node data"); }
-	size_t n_children() const { return backend.getChildren().size(); }
-	CapnpNodeData<P> child(size_t i) const { return CapnpNodeData(backend.getChildren()[i]); }
+	
+	size_t n_children() const {
+		if(is_flat)
+			return flat[index].getNumChildren();
+		
+		return backend.getChildren().size();
+	}
+	
+	CapnpNodeData<P> child(size_t i) const {
+		if(is_flat)
+			return CapnpNodeData(flat, flat[index].getFirstChild() + i);
+		
+		return CapnpNodeData(backend.getChildren()[i]);
+	}
 	
 	Box<P> bounding_box() const {
 		Box<P> result;
 		
+		if(is_flat) {
+			const auto node = flat[index];
+			const double min[3] = {node.getMinX(), node.getMinY(), node.getMinZ()};
+			const double max[3] = {node.getMaxX(), node.getMaxY(), node.getMaxZ()};
+			
+			for(size_t d = 0; d < P::dimension && d < 3; ++d) {
+				result.min()[d] = min[d];
+				result.max()[d] = max[d];
+			}
+			
+			return result;
+		}
+		
 		for(size_t d = 0; d < P::dimension; ++d) {
 			result.min()[d] = backend.getBoundingBox().getMin()[d];
 			result.max()[d] = backend.getBoundingBox().getMax()[d];
@@ -99,27 +278,79 @@ struct CapnpNodeData {
 	}
 };
 
+// Version 0 files store one list per grid cell, later versions a single CSR index array
 struct CapnpGridData {
+	using List = ::capnp::List<uint32_t>;
+	using IndexBuffer = CapnpBufferReader<uint32_t>;
+	
+	// Entries [first, last) of either a cell list or the CSR index array
+	struct Range {
+		struct Iterator {
+			const Range* range;
+			uint32_t i;
+			
+			uint32_t operator*() const { return range -> csr != nullptr ? range -> csr -> get(i) : range -> list[i]; }
+			Iterator& operator++() { ++i; return *this; }
+			bool operator!=(const Iterator& other) const { return i != other.i; }
+			bool operator==(const Iterator& other) const { return i == other.i; }
+		};
+		
+		List::Reader list;
+		const IndexBuffer* csr;
+		uint32_t first;
+		uint32_t last;
+		
+		Iterator begin() const { return Iterator{this, first}; }
+		Iterator end() const { return Iterator{this, last}; }
+		size_t size() const { return last - first; }
+	};
+	
 	capnp::GeoGrid::Reader backend;
-	CapnpGridData(capnp::GeoGrid::Reader backend) :
-		backend(backend)
+	bool is_csr;
+	IndexBuffer indices;
+	
+	CapnpGridData(capnp::GeoGrid::Reader backend, uint32_t version = 0) :
+		backend(backend), is_csr(version >= 1), indices(indices_for(backend, version))
 	{}
 	
-	const ::capnp::List<uint32_t>::Reader get(size_t i) const { 
-		return backend.getData()[i];
+	Range get(size_t i) const {
+		if(is_csr)
+			return Range{List::Reader(), &indices, backend.getOffsets()[i], backend.getOffsets()[i + 1]};
+		
+		const List::Reader cell = backend.getData()[i];
+		return Range{cell, nullptr, 0, cell.size()};
 	}
 	
-	size_t size() {
+	size_t size() const {
+		if(is_csr)
+			return backend.getOffsets().size() == 0 ? 0 : backend.getOffsets().size() - 1;
+		
 		return backend.getData().size();
 	}
 	
-	void reset(size_t n) {
+	void reset(size_t) {
 		throw std::logic_error("Can not reset capnp grid data");
 	}
 	
-	void insert(size_t n, size_t val) {
+	void count(size_t) {
+		throw std::logic_error("Can not insert into capnp grid data");
+	}
+	
+	void allocate() {
 		throw std::logic_error("Can not insert into capnp grid data");
 	}
+	
+	void insert(size_t, size_t) {
+		throw std::logic_error("Can not insert into capnp grid data");
+	}
+	
+private:
+	static IndexBuffer indices_for(capnp::GeoGrid::Reader backend, uint32_t version) {
+		if(version >= 2)
+			return IndexBuffer(backend.getIndexChunks(), {backend.getIndexChunks().getSize(), 1});
+		
+		return IndexBuffer(backend.getIndices(), {backend.getIndices().size(), 1});
+	}
 };
 
 template<size_t dim, typename Num, typename Idx, typename Tag>
@@ -140,13 +371,13 @@ struct CapnpTriangleMesh :
 	
 	using InlinePoint = point_for<Point>;
 	
-	CapnpTriangleMesh(capnp::GeoTree::Reader reader) :
+	CapnpTriangleMesh(capnp::GeoTree::Reader reader, uint32_t version = 0) :
 		MeshType(
-			CapnpBufferReader<Num>(reader.getData(),    {reader.getData().size() / dim , dim}),
-			CapnpBufferReader<Idx>(reader.getIndices(), {reader.getIndices().size() / 3, 3  }),
-			CapnpBufferReader<Tag>(reader.getTags(),    {reader.getIndices().size() / 3, reader.getNumTags()}),
-			CapnpNodeData<::tinygeo::Point<dim, Num>>(reader.getTreeRoot()),
-			CapnpGridData(reader.getGrid())
+			point_buffer_for(reader, version),
+			buffer_for<Idx>(reader.getIndices(), reader.getIndexChunks(), version, {n_triangles(reader, version), 3}),
+			buffer_for<Tag>(reader.getTags(),    reader.getTagChunks(),   version, {n_triangles(reader, version), reader.getNumTags()}),
+			root_for(reader, version),
+			CapnpGridData(reader.getGrid(), version)
 		)
 	{
 		if(reader.getDimension() != dim) {
@@ -155,31 +386,213 @@ struct CapnpTriangleMesh :
 		
 		for(size_t d = 0; d < dim; ++d)
 			this -> grid.size[d] = reader.getGrid().getSize()[d];
+		
+		if(is_lossy(reader, version))
+			decode_points(reader);
 	}
 	
-	static std::shared_ptr<CapnpTriangleMesh<dim, Num, Idx, Tag>> load(const std::string& filename) {
+	CapnpTriangleMesh(capnp::GeoFile::Reader file) :
+		CapnpTriangleMesh(checked_version(file) >= 3 ? file.getTree() : file.getData(), file.getVersion())
+	{}
+	
+	/** Loads a file saved by capnp::save_file. Files saved with SaveOptions::packed require LoadMode::packed,
+	 *  all others LoadMode::stream or LoadMode::mmap. */
+	static std::shared_ptr<CapnpTriangleMesh<dim, Num, Idx, Tag>> load(const std::string& filename, LoadMode mode = default_load_mode) {
 		#if _WIN32 && !__MINGW32__
 		const int fd = _open(filename.c_str(), _O_BINARY | _O_RDONLY);
 		#else
 		const int fd = open(filename.c_str(), O_RDONLY);
 		#endif
 		
+		if(fd < 0)
+			throw std::runtime_error("Could not open file " + filename);
+		
+		// The encoding is not recorded in the file, and reading a packed file as an unpacked message fails
+		// with obscure errors. The segment table is therefore checked up front.
+		if(mode != LoadMode::packed && !internal::is_unpacked_message(filename)) {
+			close(fd);
+			throw std::runtime_error("File " + filename + " is not an unpacked Cap'n'proto message. Files saved with packed encoding must be loaded with LoadMode::packed.");
+		}
+		
 		::capnp::ReaderOptions options;
 		options.traversalLimitInWords = ((uint64_t) 1) << 60;//8 * 1024 * 1024 * 1024;
+		
+		if(mode == LoadMode::packed)
+			return load_stream<::capnp::PackedFdMessageReader>(fd, options);
+		
+		#if !_WIN32
+		if(mode == LoadMode::mmap)
+			return load_mapped(fd, options);
+		#endif
+		
+		return load_stream<::capnp::StreamFdMessageReader>(fd, options);
+	}
+	
+	// Vertices of lossy encodings, decoded on load. point_buffer refers to this storage.
+	std::vector<Num> decoded_points;
+	
+private:
+	static uint32_t checked_version(capnp::GeoFile::Reader file) {
+		if(file.getVersion() > 3)
+			throw std::runtime_error("Unsupported file version " + std::to_string(file.getVersion()));
+		
+		return file.getVersion();
+	}
+	
+	template<typename T>
+	static size_t size_of(typename ::capnp::List<T>::Reader list, capnp::GeoArray::Reader array, uint32_t version) {
+		return version >= 2 ? array.getSize() : list.size();
+	}
+	
+	static size_t n_triangles(capnp::GeoTree::Reader reader, uint32_t version) {
+		return size_of<Idx>(reader.getIndices(), reader.getIndexChunks(), version) / 3;
+	}
+	
+	template<typename T>
+	static CapnpBufferReader<T> buffer_for(typename ::capnp::List<T>::Reader list, capnp::GeoArray::Reader array, uint32_t version, std::array<size_t, 2> shape) {
+		if(version >= 2)
+			return CapnpBufferReader<T>(array, shape);
+		
+		return CapnpBufferReader<T>(list, shape);
+	}
+	
+	static bool is_lossy(capnp::GeoTree::Reader reader, uint32_t version) {
+		return version >= 2 && reader.getVertexEncoding() != capnp::GeoVertexEncoding::FLOAT64;
+	}
+	
+	// Lossy encodings are decoded in the constructor body. Until then the point buffer has no storage.
+	static CapnpBufferReader<Num> point_buffer_for(capnp::GeoTree::Reader reader, uint32_t version) {
+		const size_t n_points = size_of<Num>(reader.getData(), reader.getDataChunks(), version) / dim;
+		
+		if(is_lossy(reader, version))
+			return CapnpBufferReader<Num>((const Num*) nullptr, {n_points, dim});
+		
+		return buffer_for<Num>(reader.getData(), reader.getDataChunks(), version, {n_points, dim});
+	}
+	
+	void decode_points(capnp::GeoTree::Reader reader) {
+		const auto array = reader.getDataChunks();
+		const size_t n = array.getSize();
+		const std::array<size_t, 2> shape = {n / dim, dim};
+		
+		const auto frame = this -> root_data.bounding_box();
+		const auto lo = frame.min();
+		const auto hi = frame.max();
+		
+		decoded_points.resize(n);
+		
+		auto clamp = [&](Num value, size_t d) {
+			return std::min(std::max(value, (Num) lo[d]), (Num) hi[d]);
+		};
+		
+		switch(reader.getVertexEncoding()) {
+			case capnp::GeoVertexEncoding::FLOAT32: {
+				const CapnpBufferReader<float> raw(array, shape);
 				
-		::capnp::StreamFdMessageReader* message = new ::capnp::StreamFdMessageReader(fd, options);
+				parallel::parallel_for(0, n, [&](size_t i) {
+					decoded_points[i] = clamp(raw.get(i), i % dim);
+				}, 4096);
+				break;
+			}
+			case capnp::GeoVertexEncoding::QUANTIZED16: {
+				const CapnpBufferReader<uint16_t> raw(array, shape);
+				
+				parallel::parallel_for(0, n, [&](size_t i) {
+					const size_t d = i % dim;
+					decoded_points[i] = clamp(lo[d] + raw.get(i) * ((hi[d] - lo[d]) / 65535), d);
+				}, 4096);
+				break;
+			}
+			default:
+				throw std::runtime_error("Unknown vertex encoding");
+		}
 		
-		auto deleter = [=](MeshType* in) {
+		this -> point_buffer = CapnpBufferReader<Num>(decoded_points.data(), shape);
+	}
+	
+	template<typename MessageReader>
+	static std::shared_ptr<CapnpTriangleMesh<dim, Num, Idx, Tag>> load_stream(int fd, const ::capnp::ReaderOptions& options) {
+		MessageReader* message = nullptr;
+		CapnpTriangleMesh<dim, Num, Idx, Tag>* mesh = nullptr;
+		
+		try {
+			message = new MessageReader(fd, options);
+			mesh = new CapnpTriangleMesh<dim, Num, Idx, Tag>(message -> template getRoot<capnp::GeoFile>());
+		} catch(...) {
+			delete message;
+			close(fd);
+			throw;
+		}
+		
+		auto deleter = [=](CapnpTriangleMesh<dim, Num, Idx, Tag>* in) {
 			delete in;
 			delete message;
 			close(fd);
 		};
 		
-		return std::shared_ptr<CapnpTriangleMesh<dim, Num, Idx, Tag>>(
-			new CapnpTriangleMesh<dim, Num, Idx, Tag>(message -> getRoot<capnp::GeoFile>().getData()),
-			deleter
-		);
+		return std::shared_ptr<CapnpTriangleMesh<dim, Num, Idx, Tag>>(mesh, deleter);
+	}
+	
+	static CapnpNodeData<::tinygeo::Point<dim, Num>> root_for(capnp::GeoTree::Reader reader, uint32_t version) {
+		if(version == 0)
+			return CapnpNodeData<::tinygeo::Point<dim, Num>>(reader.getTreeRoot());
+		
+		if(dim > 3)
+			throw std::logic_error("Flat node tables only support up to 3 dimensions");
+		
+		if(reader.getNodes().size() == 0)
+			throw std::runtime_error("File has an empty node table");
+		
+		return CapnpNodeData<::tinygeo::Point<dim, Num>>(reader.getNodes(), 0);
+	}
+	
+	#if !_WIN32
+	// Reads the message in place from a read-only mapping of the file. The mapping outlives the
+	// file descriptor and is released by the deleter of the returned pointer.
+	static std::shared_ptr<CapnpTriangleMesh<dim, Num, Idx, Tag>> load_mapped(int fd, const ::capnp::ReaderOptions& options) {
+		struct stat info;
+		if(fstat(fd, &info) != 0) {
+			close(fd);
+			throw std::runtime_error("Could not determine file size");
+		}
+		
+		const size_t size = info.st_size;
+		
+		if(size == 0 || size % sizeof(::capnp::word) != 0) {
+			close(fd);
+			throw std::runtime_error("File size is not a multiple of the Cap'n'proto word size");
+		}
+		
+		void* mapping = mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0);
+		close(fd);
+		
+		if(mapping == MAP_FAILED)
+			throw std::runtime_error("Could not map file into memory");
+		
+		::capnp::FlatArrayMessageReader* message = nullptr;
+		CapnpTriangleMesh<dim, Num, Idx, Tag>* mesh = nullptr;
+		
+		try {
+			message = new ::capnp::FlatArrayMessageReader(
+				kj::ArrayPtr<const ::capnp::word>(static_cast<const ::capnp::word*>(mapping), size / sizeof(::capnp::word)),
+				options
+			);
+			mesh = new CapnpTriangleMesh<dim, Num, Idx, Tag>(message -> getRoot<capnp::GeoFile>());
+		} catch(...) {
+			delete message;
+			munmap(mapping, size);
+			throw;
+		}
+		
+		auto deleter = [=](CapnpTriangleMesh<dim, Num, Idx, Tag>* in) {
+			delete in;
+			delete message;
+			munmap(mapping, size);
+		};
+		
+		return std::shared_ptr<CapnpTriangleMesh<dim, Num, Idx, Tag>>(mesh, deleter);
 	}
+	#endif
 };
 
 namespace capnp {
@@ -234,17 +647,326 @@ void save_grid_data(const G& data, GeoGrid::Builder target) {
 	}
 }
 
+template<typename N>
+size_t count_nodes(const N& data) {
+	size_t result = 1;
+	
+	for(size_t i = 0; i < data.n_children(); ++i)
+		result += count_nodes(data.child(i));
+	
+	return result;
+}
+
+// Writes node 'index' of a flat node table and its subtree. The children of every node are
+// placed in one contiguous block starting at 'next'. All boxes except the root box are enlarged by padding.
+template<typename N>
+void save_flat_node(const N& data, ::capnp::List<GeoFlatNode>::Builder target, size_t index, size_t& next, const std::array<double, 3>& padding) {
+	auto out = target[index];
+	
+	auto r = data.range();
+	out.setBegin(r.first);
+	out.setEnd(r.second);
+	
+	auto bb = data.bounding_box();
+	constexpr size_t dimension = decltype(bb)::Point::dimension;
+	
+	if(dimension > 3)
+		throw std::logic_error("Version 1 files only support up to 3 dimensions");
+	
+	double min[3] = {0, 0, 0};
+	double max[3] = {0, 0, 0};
+	for(size_t d = 0; d < dimension && d < 3; ++d) {
+		min[d] = bb.min()[d];
+		max[d] = bb.max()[d];
+		
+		if(index != 0) {
+			min[d] -= padding[d];
+			max[d] += padding[d];
+		}
+	}
+	
+	out.setMinX(min[0]); out.setMinY(min[1]); out.setMinZ(min[2]);
+	out.setMaxX(max[0]); out.setMaxY(max[1]); out.setMaxZ(max[2]);
+	
+	const size_t n_children = data.n_children();
+	const size_t first_child = next;
+	next += n_children;
+	
+	out.setFirstChild(first_child);
+	out.setNumChildren(n_children);
+	
+	for(size_t i = 0; i < n_children; ++i)
+		save_flat_node(data.child(i), target, first_child + i, next, padding);
+}
+
+template<typename N>
+void save_flat_nodes(const N& root, GeoTree::Builder target, const std::array<double, 3>& padding = {}) {
+	auto nodes = target.initNodes(count_nodes(root));
+	
+	size_t next = 1;
+	save_flat_node(root, nodes, 0, next, padding);
+}
+
+// Writes the CSR offsets of a grid and returns them
+template<typename G>
+std::vector<size_t> save_grid_offsets(const G& data, GeoGrid::Builder target) {
+	std::vector<size_t> result(data.size() + 1);
+	auto offsets = target.initOffsets(data.size() + 1);
+	
+	offsets.set(0, 0);
+	for(size_t i = 0; i < data.size(); ++i) {
+		result[i + 1] = result[i] + data.get(i).size();
+		
+		if(result[i + 1] > std::numeric_limits<uint32_t>::max())
+			throw std::length_error("Grid has too many entries for 32bit offsets");
+		
+		offsets.set(i + 1, result[i + 1]);
+	}
+	
+	return result;
+}
+
+template<typename G>
+void save_csr_grid_data(const G& data, GeoGrid::Builder target) {
+	const std::vector<size_t> offsets = save_grid_offsets(data, target);
+	auto indices = target.initIndices(offsets.back());
+	
+	size_t j = 0;
+	for(size_t i = 0; i < data.size(); ++i) {
+		for(auto idx : data.get(i))
+			indices.set(j++, idx);
+	}
+}
+
+// Work items of a save. Lists are allocated serially (message builders are not thread safe), the
+// copies into them are collected and run in parallel afterwards.
+using SaveTasks = std::vector<std::function<void()>>;
+
+namespace internal {
+	// Elements per chunk of a GeoArray. Chunks of doubles are 128MB, well below the limit of a single Data blob.
+	constexpr size_t chunk_bits = 24;
+	constexpr size_t chunk_size = (size_t) 1 << chunk_bits;
+	
+	// Writable view of a chunked array allocated in a message
+	template<typename T>
+	struct ChunkedArray {
+		std::vector<T*> chunks;
+		size_t size;
+		
+		T& operator[](size_t i) const {
+			return chunks[i >> chunk_bits][i & (chunk_size - 1)];
+		}
+		
+		size_t chunk_begin(size_t c) const { return c << chunk_bits; }
+		size_t chunk_end(size_t c) const { return std::min(size, (c + 1) << chunk_bits); }
+	};
+	
+	template<typename T>
+	ChunkedArray<T> init_array(GeoArray::Builder out, size_t size) {
+		out.setSize(size);
+		out.setChunkSize(chunk_size);
+		
+		ChunkedArray<T> result;
+		result.size = size;
+		
+		auto chunks = out.initChunks((size + chunk_size - 1) / chunk_size);
+		for(size_t c = 0; c < chunks.size(); ++c) {
+			auto bytes = chunks.init(c, (result.chunk_end(c) - result.chunk_begin(c)) * sizeof(T));
+			result.chunks.push_back(reinterpret_cast<T*>(bytes.begin()));
+		}
+		
+		return result;
+	}
+	
+	// Row-major storage of a buffer if it provides one with elements of type T, nullptr otherwise
+	template<typename T, typename B>
+	auto contiguous_data(const B& buf, int) -> decltype(static_cast<const T*>(buf.contiguous_data())) {
+		return buf.contiguous_data();
+	}
+	
+	template<typename T, typename B>
+	const T* contiguous_data(const B&, long) {
+		return nullptr;
+	}
+}
+
+// Allocates a chunked array for a buffer and schedules its copy. Buffers with contiguous storage of
+// the matching type are copied with memcpy, others element by element.
+template<typename T, typename B>
+void save_array(const B& buf, GeoArray::Builder out, SaveTasks& tasks) {
+	const size_t n_cols = buf.shape(1);
+	const internal::ChunkedArray<T> target = internal::init_array<T>(out, buf.shape(0) * n_cols);
+	
+	for(size_t c = 0; c < target.chunks.size(); ++c) {
+		tasks.push_back([&buf, target, c, n_cols]() {
+			const size_t begin = target.chunk_begin(c);
+			const size_t end = target.chunk_end(c);
+			
+			const T* src = internal::contiguous_data<T>(buf, 0);
+			if(src != nullptr) {
+				std::memcpy(target.chunks[c], src + begin, (end - begin) * sizeof(T));
+				return;
+			}
+			
+			for(size_t li = begin; li < end; ++li)
+				target[li] = buf(li / n_cols, li % n_cols);
+		});
+	}
+}
+
+// Stores the vertices of a mesh in a lossy encoding relative to the bounding box of its root. Returns
+// the maximum coordinate error per dimension.
+template<typename Mesh>
+std::array<double, 3> save_encoded_points(Mesh& mesh, VertexEncoding encoding, GeoArray::Builder out, SaveTasks& tasks) {
+	constexpr size_t dim = Mesh::dimension;
+	
+	const auto frame = mesh.root_data.bounding_box();
+	if(is_empty(frame))
+		throw std::logic_error("Lossy vertex encodings require a packed mesh");
+	
+	std::array<double, 3> lo = {0, 0, 0};
+	std::array<double, 3> hi = {0, 0, 0};
+	std::array<double, 3> error = {0, 0, 0};
+	
+	for(size_t d = 0; d < dim && d < 3; ++d) {
+		lo[d] = frame.min()[d];
+		hi[d] = frame.max()[d];
+		
+		// Twice the rounding error, to also cover the arithmetic of encoding and decoding
+		if(encoding == VertexEncoding::float32)
+			error[d] = std::max(std::abs(lo[d]), std::abs(hi[d])) * std::numeric_limits<float>::epsilon();
+		else
+			error[d] = (hi[d] - lo[d]) / 65535;
+	}
+	
+	const auto& buf = mesh.point_buffer;
+	
+	if(encoding == VertexEncoding::float32) {
+		const internal::ChunkedArray<float> target = internal::init_array<float>(out, buf.shape(0) * dim);
+		
+		for(size_t c = 0; c < target.chunks.size(); ++c) {
+			tasks.push_back([&buf, target, c]() {
+				for(size_t li = target.chunk_begin(c); li < target.chunk_end(c); ++li)
+					target[li] = (float) buf(li / dim, li % dim);
+			});
+		}
+	} else {
+		const internal::ChunkedArray<uint16_t> target = internal::init_array<uint16_t>(out, buf.shape(0) * dim);
+		
+		for(size_t c = 0; c < target.chunks.size(); ++c) {
+			tasks.push_back([&buf, target, c, lo, hi]() {
+				for(size_t li = target.chunk_begin(c); li < target.chunk_end(c); ++li) {
+					const size_t d = li % dim;
+					const double extent = hi[d] - lo[d];
+					const double scaled = extent > 0 ? (buf(li / dim, d) - lo[d]) / extent * 65535 : 0;
+					
+					target[li] = (uint16_t) std::min(std::max(std::round(scaled), 0.0), 65535.0);
+				}
+			});
+		}
+	}
+	
+	return error;
+}
+
+template<typename G>
+void save_chunked_grid_data(const G& data, GeoGrid::Builder target, SaveTasks& tasks) {
+	auto offsets = std::make_shared<std::vector<size_t>>(save_grid_offsets(data, target));
+	const internal::ChunkedArray<uint32_t> indices = internal::init_array<uint32_t>(target.getIndexChunks(), offsets -> back());
+	
+	constexpr size_t cells_per_task = 4096;
+	for(size_t begin = 0; begin < data.size(); begin += cells_per_task) {
+		const size_t end = std::min(begin + cells_per_task, data.size());
+		
+		tasks.push_back([&data, offsets, indices, begin, end]() {
+			for(size_t i = begin; i < end; ++i) {
+				size_t j = (*offsets)[i];
+				
+				for(auto idx : data.get(i))
+					indices[j++] = idx;
+			}
+		});
+	}
+}
+
+/** Writes a mesh in the given layout version. Versions 2 and 3 (the default) store vertices, indices, tags
+ *  and grid entries as chunked raw arrays, which are copied in bulk and in parallel and are not limited by
+ *  the maximum list size. Version 1 stores them in plain lists. All three use a flat node table and a CSR
+ *  grid. Version 0 uses nested nodes and per-cell lists. Versions 2 and 3 only differ in the field of
+ *  GeoFile that holds the tree, see SaveOptions. */
 template<size_t dim, typename PointBuffer, typename IndexBuffer, typename TagBuffer, typename NodeData, typename GridData>
-void save_mesh(IndexedTriangleMesh<dim, PointBuffer, IndexBuffer, TagBuffer, NodeData, GridData>& mesh, capnp::GeoTree::Builder out) {
+void save_mesh(IndexedTriangleMesh<dim, PointBuffer, IndexBuffer, TagBuffer, NodeData, GridData>& mesh, capnp::GeoTree::Builder out, uint32_t version = 3, VertexEncoding vertices = VertexEncoding::float64) {
+	using Num = typename IndexedTriangleMesh<dim, PointBuffer, IndexBuffer, TagBuffer, NodeData, GridData>::Point::numeric_type;
+	
 	out.setDimension(dim);
 	out.setNumTags(mesh.tag_buffer.shape(1));
 	
-	save_buffer(mesh.point_buffer, out.initData(mesh.point_buffer.shape(0) * dim));
-	save_buffer(mesh.index_buffer, out.initIndices(mesh.index_buffer.shape(0) * 3));
-	save_buffer(mesh.tag_buffer,   out.initTags(mesh.tag_buffer.shape(0) * mesh.tag_buffer.shape(1)));
+	if(version > 3)
+		throw std::invalid_argument("Unsupported file version " + std::to_string(version));
 	
-	save_node_data(mesh.root_data, out.getTreeRoot());
-	save_grid_data(mesh.grid.data, out.getGrid());
+	if(version < 2 && vertices != VertexEncoding::float64)
+		throw std::invalid_argument("Lossy vertex encodings require file version 2 or later");
+	
+	if(version >= 2) {
+		::tinygeo::internal::check_byte_order();
+		
+		SaveTasks tasks;
+		std::array<double, 3> padding = {0, 0, 0};
+		
+		if(vertices == VertexEncoding::float64) {
+			save_array<double>(mesh.point_buffer, out.getDataChunks(), tasks);
+			out.setVertexEncoding(GeoVertexEncoding::FLOAT64);
+		} else {
+			padding = save_encoded_points(mesh, vertices, out.getDataChunks(), tasks);
+			out.setVertexEncoding(vertices == VertexEncoding::float32 ? GeoVertexEncoding::FLOAT32 : GeoVertexEncoding::QUANTIZED16);
+		}
+		
+		save_array<uint32_t>(mesh.index_buffer, out.getIndexChunks(), tasks);
+		save_array<uint32_t>(mesh.tag_buffer,   out.getTagChunks(),   tasks);
+		
+		// Files store the cells over the root box. With lossy vertices or a frame kept by refit() the grid is
+		// rebuilt, from padded triangle boxes in the former case.
+		CSRGridData padded_grid;
+		if(vertices == VertexEncoding::float64 && mesh.grid.root_framed()) {
+			save_chunked_grid_data(mesh.grid.data, out.getGrid(), tasks);
+		} else {
+			std::array<Num, dim> grid_padding;
+			for(size_t d = 0; d < dim; ++d)
+				grid_padding[d] = d < 3 ? padding[d] : 0;
+			
+			mesh.grid.fill(padded_grid, grid_padding);
+			save_chunked_grid_data(padded_grid, out.getGrid(), tasks);
+		}
+		
+		save_flat_nodes(mesh.root_data, out, padding);
+		
+		parallel::parallel_for(0, tasks.size(), [&tasks](size_t i) { tasks[i](); });
+	} else {
+		save_buffer(mesh.point_buffer, out.initData(mesh.point_buffer.shape(0) * dim));
+		save_buffer(mesh.index_buffer, out.initIndices(mesh.index_buffer.shape(0) * 3));
+		save_buffer(mesh.tag_buffer,   out.initTags(mesh.tag_buffer.shape(0) * mesh.tag_buffer.shape(1)));
+		
+		// Files store the cells over the root box, which a frame kept by refit() may differ from
+		CSRGridData refilled_grid;
+		if(!mesh.grid.root_framed())
+			mesh.grid.fill(refilled_grid);
+		
+		if(version == 0) {
+			save_node_data(mesh.root_data, out.getTreeRoot());
+			
+			if(mesh.grid.root_framed())
+				save_grid_data(mesh.grid.data, out.getGrid());
+			else
+				save_grid_data(refilled_grid, out.getGrid());
+		} else {
+			save_flat_nodes(mesh.root_data, out);
+			
+			if(mesh.grid.root_framed())
+				save_csr_grid_data(mesh.grid.data, out.getGrid());
+			else
+				save_csr_grid_data(refilled_grid, out.getGrid());
+		}
+	}
 	
 	out.getGrid().initSize(dim);
 	for(size_t d = 0; d < dim; ++d)
@@ -252,11 +974,45 @@ void save_mesh(IndexedTriangleMesh<dim, PointBuffer, IndexBuffer, TagBuffer, Nod
 }
 
 template<size_t dim, typename PointBuffer, typename IndexBuffer, typename TagBuffer, typename NodeData, typename GridData>
-void save_mesh(IndexedTriangleMesh<dim, PointBuffer, IndexBuffer, TagBuffer, NodeData, GridData>& mesh, capnp::GeoFile::Builder out) {
+void save_mesh(IndexedTriangleMesh<dim, PointBuffer, IndexBuffer, TagBuffer, NodeData, GridData>& mesh, capnp::GeoFile::Builder out, uint32_t version = 3, VertexEncoding vertices = VertexEncoding::float64) {
 	out.setHeader("This file was saved by the tinygeo library. See https://github.com/alexrobomind/tinygeo for the source code and the CapnProto schema for this file.");
-	out.setVersion(0);
+	out.setVersion(version);
+	
+	save_mesh(mesh, version >= 3 ? out.getTree() : out.getData(), version, vertices);
+}
+
+template<size_t dim, typename PointBuffer, typename IndexBuffer, typename TagBuffer, typename NodeData, typename GridData>
+void save_file(IndexedTriangleMesh<dim, PointBuffer, IndexBuffer, TagBuffer, NodeData, GridData>& mesh, const std::string& filename, const SaveOptions& options = SaveOptions()) {
+	if((options.version == 1 || options.version == 2) && !options.legacy)
+		throw std::invalid_argument("File versions 1 and 2 are read as empty meshes by old readers and require SaveOptions::legacy");
+	
+	// Build the serial representation
+	::capnp::MallocMessageBuilder builder;
+	save_mesh(mesh, builder.initRoot<GeoFile>(), options.version, options.vertices);
+	
+	// Write it out
+	#if _WIN32 && !__MINGW32__
+	// Thanks Microsoft for inventing your "own" API -.-
+	const int fd = _open(filename.c_str(), _O_CREAT | _O_TRUNC |_O_BINARY | _O_RDWR, _S_IWRITE);
+	#else
+	const int fd = open(filename.c_str(), O_CREAT | O_TRUNC | O_RDWR, S_IRUSR | S_IWUSR | S_IRGRP);
+	#endif
+	
+	if(fd < 0)
+		throw std::runtime_error("Could not open file " + filename + " for writing");
+	
+	try {
+		if(options.packed)
+			::capnp::writePackedMessageToFd(fd, builder);
+		else
+			::capnp::writeMessageToFd(fd, builder);
+	} catch(...) {
+		close(fd);
+		throw;
+	}
 	
-	save_mesh(mesh, out.getData());
+	// Provided on Win32 by kj/miniposix.h
+	close(fd);
 }
 
 }
@@ -7,7 +7,8 @@ namespace tags {
 		box,
 		triangle,
 		node,
-		grid
+		grid,
+		wide
 	};
 }
 	
@@ -0,0 +1,229 @@
+#pragma once
+
+#include <cmath>
+#include <limits>
+
+#include <tinygeo/concepts.h>
+#include <tinygeo/raytrace.h>
+
+namespace tinygeo {
+
+/** Closest point on a mesh to a query point. As for RaytraceResult, only the index of the closest
+ *  triangle is recorded. */
+template<typename P>
+struct ClosestPointResult {
+	using Num = typename P::numeric_type;
+	static constexpr size_t no_hit = std::numeric_limits<size_t>::max();
+	
+	// Squared distance during traversal, the distance once the query is finished
+	Num distance;
+	P point;
+	size_t index;
+	
+	ClosestPointResult() : distance(std::numeric_limits<Num>::infinity()), index(no_hit) {}
+	
+	bool hit() const { return index != no_hit; }
+	
+	void combine(const ClosestPointResult& other) {
+		if(other.distance < distance)
+			*this = other;
+	}
+	
+	ClosestPointResult& operator<<(const ClosestPointResult& other) {
+		combine(other);
+		return *this;
+	}
+};
+
+template<typename X>
+using closest_point_for = ClosestPointResult<point_for<typename X::Point>>;
+
+template<typename X, bool enif>
+using conditional_closest_point = std::enable_if_t<enif, closest_point_for<X>>;
+
+/** Squared distance between a point and a box. Points inside the box have distance 0. */
+template<typename B>
+typename B::Point::numeric_type box_distance_squared(const point_for<typename B::Point>& p, const B& box) {
+	using Num = typename B::Point::numeric_type;
+	
+	Num result = 0;
+	for(size_t i = 0; i < B::Point::dimension; ++i) {
+		const Num d = std::max(box.min()[i] - p[i], std::max(p[i] - box.max()[i], (Num) 0));
+		result += d * d;
+	}
+	
+	return result;
+}
+
+namespace internal {
+	template<typename Num>
+	Num dot3(const Num* a, const Num* b) {
+		return a[0] * b[0] + a[1] * b[1] + a[2] * b[2];
+	}
+	
+	// Squared distance and closest point of p on the triangle (a, b, c). Classifies p by the Voronoi
+	// regions of the vertices and edges before projecting onto the face.
+	template<typename Num>
+	Num closest_point_on_triangle(const Num* p, const Num* a, const Num* b, const Num* c, Num* out) {
+		const Num ab[3] = {b[0] - a[0], b[1] - a[1], b[2] - a[2]};
+		const Num ac[3] = {c[0] - a[0], c[1] - a[1], c[2] - a[2]};
+		const Num ap[3] = {p[0] - a[0], p[1] - a[1], p[2] - a[2]};
+		
+		// Writes a + v * ab + w * ac to out
+		auto project = [&](Num v, Num w) {
+			for(size_t i = 0; i < 3; ++i)
+				out[i] = a[i] + v * ab[i] + w * ac[i];
+		};
+		
+		const Num d1 = dot3(ab, ap);
+		const Num d2 = dot3(ac, ap);
+		
+		const Num bp[3] = {p[0] - b[0], p[1] - b[1], p[2] - b[2]};
+		const Num d3 = dot3(ab, bp);
+		const Num d4 = dot3(ac, bp);
+		
+		const Num cp[3] = {p[0] - c[0], p[1] - c[1], p[2] - c[2]};
+		const Num d5 = dot3(ab, cp);
+		const Num d6 = dot3(ac, cp);
+		
+		const Num va = d3 * d6 - d5 * d4;
+		const Num vb = d5 * d2 - d1 * d6;
+		const Num vc = d1 * d4 - d3 * d2;
+		
+		if(d1 <= 0 && d2 <= 0)
+			project(0, 0);
+		else if(d3 >= 0 && d4 <= d3)
+			project(1, 0);
+		else if(d6 >= 0 && d5 <= d6)
+			project(0, 1);
+		else if(vc <= 0 && d1 >= 0 && d3 <= 0)
+			project(d1 / (d1 - d3), 0);
+		else if(vb <= 0 && d2 >= 0 && d6 <= 0)
+			project(0, d2 / (d2 - d6));
+		else if(va <= 0 && d4 - d3 >= 0 && d5 - d6 >= 0) {
+			// Edge bc
+			const Num w = (d4 - d3) / ((d4 - d3) + (d5 - d6));
+			for(size_t i = 0; i < 3; ++i)
+				out[i] = b[i] + w * (c[i] - b[i]);
+		} else {
+			const Num denom = 1 / (va + vb + vc);
+			project(vb * denom, vc * denom);
+		}
+		
+		const Num diff[3] = {p[0] - out[0], p[1] - out[1], p[2] - out[2]};
+		return dot3(diff, diff);
+	}
+	
+	// Closest point on a triangle with the squared distance
+	template<typename T>
+	closest_point_for<T> closest_point_squared(const point_for<typename T::Point>& p, const T& tri) {
+		using P = point_for<typename T::Point>;
+		using Num = typename P::numeric_type;
+		
+		const P a = tri.template get<0>();
+		const P b = tri.template get<1>();
+		const P c = tri.template get<2>();
+		
+		const Num pp[3] = {p[0], p[1], p[2]};
+		const Num pa[3] = {a[0], a[1], a[2]};
+		const Num pb[3] = {b[0], b[1], b[2]};
+		const Num pc[3] = {c[0], c[1], c[2]};
+		Num out[3];
+		
+		ClosestPointResult<P> result;
+		result.distance = closest_point_on_triangle(pp, pa, pb, pc, out);
+		result.index = triangle_index(tri, 0);
+		
+		for(size_t i = 0; i < 3; ++i)
+			result.point[i] = out[i];
+		
+		return result;
+	}
+	
+	// Best-first traversal below a node. The result holds squared distances.
+	template<typename N>
+	void closest_point_node(const point_for<typename N::Point>& p, const N& node, closest_point_for<N>& result) {
+		using Num = typename N::Point::numeric_type;
+		using PairType = std::pair<Num, size_t>;
+		
+		constexpr size_t max_sorted = 64;
+		
+		struct StackEntry {
+			Num distance;
+			N node;
+		};
+		
+		TraversalStack<StackEntry, 256> stack;
+		
+		auto visit = [&](const N& current) {
+			for(size_t i = 0; i < current.n_data(); ++i)
+				result << closest_point_squared(p, current.data(i));
+			
+			const size_t n_children = current.n_children();
+			PairType hits[max_sorted];
+			size_t n_hits = 0;
+			
+			for(size_t i = 0; i < n_children; ++i) {
+				const N child = current.child(i);
+				const Num distance = box_distance_squared(p, child.bounding_box());
+				
+				if(!(distance < result.distance))
+					continue;
+				
+				if(n_children <= max_sorted)
+					hits[n_hits++] = PairType(distance, i);
+				else
+					stack.push(StackEntry{distance, child});
+			}
+			
+			// Push the farthest child first, so that the closest one is processed next
+			sort_descending(hits, n_hits);
+			for(size_t i = 0; i < n_hits; ++i)
+				stack.push(StackEntry{hits[i].first, current.child(hits[i].second)});
+		};
+		
+		visit(node);
+		
+		while(!stack.empty()) {
+			const StackEntry entry = stack.pop();
+			
+			if(!(entry.distance < result.distance))
+				continue;
+			
+			visit(entry.node);
+		}
+	}
+}
+
+/** Closest point in the subtree below a node. Children are visited in order of their box distance, and
+ *  subtrees whose box is farther away than the best triangle found so far are skipped. Only triangles
+ *  closer than d_max are considered. */
+template<typename N>
+conditional_closest_point<N, N::tag == tags::node> closest_point(
+	const point_for<typename N::Point>& p,
+	const N& node,
+	typename N::Point::numeric_type d_max = std::numeric_limits<typename N::Point::numeric_type>::infinity()
+) {
+	closest_point_for<N> result;
+	
+	if(d_max < std::numeric_limits<typename N::Point::numeric_type>::infinity())
+		result.distance = d_max * d_max;
+	
+	internal::closest_point_node(p, node, result);
+	
+	if(!result.hit())
+		return closest_point_for<N>();
+	
+	result.distance = std::sqrt(result.distance);
+	return result;
+}
+
+/** Closest point on a single triangle */
+template<typename T>
+conditional_closest_point<T, T::tag == tags::triangle && T::Point::dimension == 3> closest_point(const point_for<typename T::Point>& p, const T& tri) {
+	auto result = internal::closest_point_squared(p, tri);
+	result.distance = std::sqrt(result.distance);
+	return result;
+}
+
+}
@@ -0,0 +1,124 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <numeric>
+#include <vector>
+
+#include <tinygeo/box.h>
+
+namespace tinygeo {
+
+namespace internal {
+	// Moves bit i of x to bit 3 i (for x < 2^21)
+	inline std::uint64_t spread_bits_3(std::uint64_t x) {
+		x = (x | x << 32) & 0x1f00000000ffffull;
+		x = (x | x << 16) & 0x1f0000ff0000ffull;
+		x = (x | x << 8)  & 0x100f00f00f00f00full;
+		x = (x | x << 4)  & 0x10c30c30c30c30c3ull;
+		x = (x | x << 2)  & 0x1249249249249249ull;
+		return x;
+	}
+	
+	// Moves bit i of x to bit 2 i (for x < 2^32)
+	inline std::uint64_t spread_bits_2(std::uint64_t x) {
+		x = (x | x << 16) & 0x0000ffff0000ffffull;
+		x = (x | x << 8)  & 0x00ff00ff00ff00ffull;
+		x = (x | x << 4)  & 0x0f0f0f0f0f0f0f0full;
+		x = (x | x << 2)  & 0x3333333333333333ull;
+		x = (x | x << 1)  & 0x5555555555555555ull;
+		return x;
+	}
+}
+
+/** Morton (Z-order) code of a point within a box. Each coordinate is quantized to the given number of bits
+ *  and the bits of all coordinates are interleaved, with the most significant bits first. Points outside
+ *  the box are clamped onto it. Requires dimension * bits <= 64. */
+template<typename B>
+std::uint64_t morton_code(const point_for<typename B::Point>& p, const B& box, size_t bits) {
+	using Num = typename B::Point::numeric_type;
+	constexpr size_t dim = B::Point::dimension;
+	
+	const std::uint64_t max_cell = (std::uint64_t(1) << bits) - 1;
+	
+	std::uint64_t cells[dim];
+	for(size_t i = 0; i < dim; ++i) {
+		const Num extent = box.max()[i] - box.min()[i];
+		const Num x = extent > 0 ? (p[i] - box.min()[i]) / extent * (max_cell + 1) : 0;
+		
+		// Also catches NaN
+		cells[i] = x > 0 ? std::min((std::uint64_t) x, max_cell) : 0;
+	}
+	
+	if(dim == 3)
+		return internal::spread_bits_3(cells[0]) << 2 | internal::spread_bits_3(cells[1]) << 1 | internal::spread_bits_3(cells[dim - 1]);
+	
+	if(dim == 2)
+		return internal::spread_bits_2(cells[0]) << 1 | internal::spread_bits_2(cells[dim - 1]);
+	
+	std::uint64_t result = 0;
+	for(size_t b = bits; b-- > 0; ) {
+		for(size_t i = 0; i < dim; ++i)
+			result = (result << 1) | ((cells[i] >> b) & 1);
+	}
+	
+	return result;
+}
+
+namespace internal {
+	// Stable LSD radix sort of values by their keys, 11 bits per pass. Passes in which all keys have the
+	// same digit are skipped, so small key ranges sort quickly.
+	template<typename V>
+	void radix_sort(std::vector<std::uint64_t>& keys, std::vector<V>& values) {
+		constexpr size_t digit_bits = 11;
+		constexpr size_t n_digits = size_t(1) << digit_bits;
+		constexpr std::uint64_t mask = n_digits - 1;
+		
+		const size_t n = keys.size();
+		
+		std::vector<std::uint64_t> key_buffer(n);
+		std::vector<V> value_buffer(n);
+		std::vector<size_t> counts(n_digits + 1);
+		
+		for(size_t shift = 0; shift < 64; shift += digit_bits) {
+			std::fill(counts.begin(), counts.end(), 0);
+			for(size_t i = 0; i < n; ++i)
+				++counts[((keys[i] >> shift) & mask) + 1];
+			
+			if(std::find(counts.begin() + 1, counts.end(), n) != counts.end())
+				continue;
+			
+			std::partial_sum(counts.begin(), counts.end(), counts.begin());
+			
+			for(size_t i = 0; i < n; ++i) {
+				const size_t target = counts[(keys[i] >> shift) & mask]++;
+				key_buffer[target] = keys[i];
+				value_buffer[target] = values[i];
+			}
+			
+			keys.swap(key_buffer);
+			values.swap(value_buffer);
+		}
+	}
+	
+	// Permutation that sorts the keys. The keys are sorted along.
+	inline std::vector<size_t> sort_order(std::vector<std::uint64_t>& keys) {
+		std::vector<size_t> order(keys.size());
+		std::iota(order.begin(), order.end(), (size_t) 0);
+		
+		radix_sort(keys, order);
+		return order;
+	}
+}
+
+/** Sort key grouping segments by direction octant first and by the Morton code of their origin within the
+ *  box second. Tracing segments in key order makes consecutive segments coherent. */
+template<typename B>
+std::uint64_t ray_order_key(const point_for<typename B::Point>& origin, const point_for<typename B::Point>& direction, const B& box) {
+	static_assert(B::Point::dimension == 3, "Ray order keys are defined for 3D segments");
+	
+	const std::uint64_t octant = (direction[0] < 0 ? 4 : 0) | (direction[1] < 0 ? 2 : 0) | (direction[2] < 0 ? 1 : 0);
+	return (octant << 60) | morton_code(origin, box, 20);
+}
+
+}
@@ -3,9 +3,14 @@
 #include <vector>
 #include <utility>
 #include <algorithm>
+#include <iterator>
+#include <array>
+#include <tuple>
 
 #include <tinygeo/point.h>
 #include <tinygeo/box.h>
+#include <tinygeo/parallel.h>
+#include <tinygeo/morton.h>
 
 #if 0
 	template<typename T>
@@ -14,7 +19,7 @@
 	}
 #else
 	template<typename T>
-	void packprint(const T& t) {}
+	void packprint(const T&) {}
 #endif
 
 namespace tinygeo {
@@ -37,6 +42,159 @@ namespace tinygeo {
 	template<typename T>
 	using PackResult = std::vector<PackNode<T>>;
 	
+	namespace internal {
+		// A pending multi-selection: The range [begin, end) of the indirection array needs to be partitioned
+		// at all positions in [b_begin, b_end)
+		struct SelectTask {
+			size_t begin;
+			size_t end;
+			const size_t* b_begin;
+			const size_t* b_end;
+		};
+		
+		// Ranges below this size are selected with a single nth_element
+		constexpr size_t parallel_select_min = (size_t) 1 << 16;
+		
+		// Stable three-way partition of [begin, end) into the elements before lo, the elements from lo to hi
+		// and the elements after hi, in parallel over blocks. Returns the start of the second and third part.
+		template<typename Comparator>
+		std::pair<size_t, size_t> parallel_partition(std::vector<size_t>& values, std::vector<size_t>& buffer, size_t begin, size_t end, size_t lo, size_t hi, const Comparator& comparator) {
+			constexpr size_t block_min = 4096;
+			
+			const size_t n = end - begin;
+			const size_t n_blocks = std::max((size_t) 1, std::min(n / block_min, 4 * parallel::num_threads()));
+			
+			auto part_of = [&](size_t value) -> size_t {
+				return comparator(value, lo) ? 0 : comparator(hi, value) ? 2 : 1;
+			};
+			
+			auto block_begin = [&](size_t b) { return begin + n * b / n_blocks; };
+			
+			// Number of elements per part in every block, turned into output offsets below
+			std::vector<std::array<size_t, 3>> offsets(n_blocks);
+			parallel::parallel_for(0, n_blocks, [&](size_t b) {
+				std::array<size_t, 3> counts = {0, 0, 0};
+				for(size_t i = block_begin(b); i < block_begin(b + 1); ++i)
+					++counts[part_of(values[i])];
+				
+				offsets[b] = counts;
+			});
+			
+			std::array<size_t, 3> totals = {0, 0, 0};
+			for(size_t b = 0; b < n_blocks; ++b) {
+				for(size_t part = 0; part < 3; ++part)
+					totals[part] += offsets[b][part];
+			}
+			
+			std::array<size_t, 3> next = {begin, begin + totals[0], begin + totals[0] + totals[1]};
+			for(size_t b = 0; b < n_blocks; ++b) {
+				for(size_t part = 0; part < 3; ++part) {
+					const size_t count = offsets[b][part];
+					offsets[b][part] = next[part];
+					next[part] += count;
+				}
+			}
+			
+			parallel::parallel_for(0, n_blocks, [&](size_t b) {
+				std::array<size_t, 3> target = offsets[b];
+				for(size_t i = block_begin(b); i < block_begin(b + 1); ++i)
+					buffer[target[part_of(values[i])]++] = values[i];
+			});
+			
+			parallel::parallel_for(0, n_blocks, [&](size_t b) {
+				std::copy(buffer.begin() + block_begin(b), buffer.begin() + block_begin(b + 1), values.begin() + block_begin(b));
+			});
+			
+			return std::make_pair(begin + totals[0], begin + totals[0] + totals[1]);
+		}
+		
+		/** Same result as nth_element on [begin, end) at k, using all threads. Every round brackets the k-th element
+		 *  between two pivots drawn from a sample and partitions the range around them in parallel, until the range
+		 *  containing k is small enough for nth_element. Requires a strict total order. */
+		template<typename Comparator>
+		void parallel_select(std::vector<size_t>& values, std::vector<size_t>& buffer, size_t begin, size_t end, size_t k, const Comparator& comparator) {
+			constexpr size_t n_samples = 1024;
+			constexpr size_t spread = 32;
+			
+			std::vector<size_t> samples(n_samples);
+			
+			while(end - begin > parallel_select_min) {
+				const size_t n = end - begin;
+				
+				for(size_t i = 0; i < n_samples; ++i)
+					samples[i] = values[begin + n * i / n_samples];
+				
+				std::sort(samples.begin(), samples.end(), comparator);
+				
+				const size_t rank = (k - begin) * n_samples / n;
+				const size_t lo = samples[rank > spread ? rank - spread : 0];
+				const size_t hi = samples[std::min(rank + spread, n_samples - 1)];
+				
+				const auto bounds = parallel_partition(values, buffer, begin, end, lo, hi, comparator);
+				
+				size_t new_begin = begin;
+				size_t new_end = end;
+				
+				if(k < bounds.first)
+					new_end = bounds.first;
+				else if(k < bounds.second)
+					std::tie(new_begin, new_end) = bounds;
+				else
+					new_begin = bounds.second;
+				
+				if(new_end - new_begin == n)
+					break;
+				
+				begin = new_begin;
+				end = new_end;
+			}
+			
+			std::nth_element(values.begin() + begin, values.begin() + k, values.begin() + end, comparator);
+		}
+		
+		/** Partitions the ranges in tasks so that every boundary position holds the element that a full sort would
+		 *  place there, with all smaller elements in front of it. Every round splits all tasks at their median
+		 *  boundary. Rounds with enough tasks process them in parallel with nth_element, while the first rounds
+		 *  (fewer tasks than threads) split each large task with parallel_select. */
+		template<typename Comparator>
+		void multi_select(std::vector<size_t>& indirections, std::vector<SelectTask> tasks, const Comparator& comparator) {
+			std::vector<size_t> buffer;
+			
+			while(!tasks.empty()) {
+				std::vector<SelectTask> next(2 * tasks.size());
+				
+				auto split = [&](size_t i_task, bool parallel) {
+					const SelectTask& task = tasks[i_task];
+					const size_t* mid = task.b_begin + (task.b_end - task.b_begin) / 2;
+					
+					if(parallel && task.end - task.begin > parallel_select_min) {
+						if(buffer.empty())
+							buffer.resize(indirections.size());
+						
+						parallel_select(indirections, buffer, task.begin, task.end, *mid, comparator);
+					} else
+						std::nth_element(indirections.begin() + task.begin, indirections.begin() + *mid, indirections.begin() + task.end, comparator);
+					
+					next[2 * i_task]     = SelectTask{task.begin, *mid, task.b_begin, mid};
+					next[2 * i_task + 1] = SelectTask{*mid, task.end, mid + 1, task.b_end};
+				};
+				
+				if(tasks.size() < parallel::num_threads()) {
+					for(size_t i_task = 0; i_task < tasks.size(); ++i_task)
+						split(i_task, true);
+				} else {
+					parallel::parallel_for(0, tasks.size(), [&](size_t i_task) { split(i_task, false); });
+				}
+				
+				tasks.clear();
+				for(const SelectTask& task : next) {
+					if(task.b_begin != task.b_end)
+						tasks.push_back(task);
+				}
+			}
+		}
+	}
+	
 	template<typename It1, typename It2>
 	PackResult<typename It1::value_type> pack_static(It1 begin, It2 end, size_t leaf_size) {
 		//static_assert(std::is_same<typename It1::value_type, typename It2::value_type>::value);
@@ -45,18 +203,16 @@ namespace tinygeo {
 		using P = typename T::Point;
 		static constexpr size_t dim = P::dimension;
 		
-		// Allocate storage for leaf data and center points
-		using PairType = std::pair<T, point_for<typename T::Point>>;
-		std::vector<PairType> storage;
-		storage.reserve(std::distance(begin, end));
+		// Take over the input elements (which are moved if passed through move iterators)
+		std::vector<T> storage;
+		for(It1 it = begin; it != end; ++it)
+			storage.push_back(*it);
 		
-		// Copy inputs and cache bounding box center
-		{
-			auto transformer = [](const T& in) {
-				return PairType(in, center(in.bounding_box()));
-			};
-			std::transform(begin, end, std::back_inserter(storage), transformer);
-		}
+		// Cache bounding box centers
+		std::vector<point_for<P>> centers(storage.size());
+		parallel::parallel_for(0, storage.size(), [&](size_t i) {
+			centers[i] = center(storage[i].bounding_box());
+		}, 1024);
 		
 		std::vector<size_t> indirections(storage.size());
 		for(size_t i = 0; i < storage.size(); ++i)
@@ -111,22 +267,37 @@ namespace tinygeo {
 			}
 		}
 		
-		// Execute sorting strategy
+		// Execute sorting strategy. Only the sub-range boundaries of the next stage need to be in sorted
+		// position, so instead of sorting every range we partition it around these boundaries. Ties are
+		// broken by input position to make the result independent of the order of execution.
 		for(size_t i_dim = 0; i_dim < dim; ++i_dim) {
-			packprint("Sorting dimension " + std::to_string(i_dim));
+			packprint("Partitioning dimension " + std::to_string(i_dim));
 			const std::vector<size_t>& idx = indices[i_dim];
+			const std::vector<size_t>& sub_idx = indices[i_dim + 1];
 			
-			auto comparator = [i_dim, &storage](size_t i1, size_t i2) {
-				const PairType& p1 = storage[i1];
-				const PairType& p2 = storage[i2];
-				return p1.second[i_dim] < p2.second[i_dim];
+			auto comparator = [i_dim, &centers](size_t i1, size_t i2) {
+				const auto c1 = centers[i1][i_dim];
+				const auto c2 = centers[i2][i_dim];
+				return c1 < c2 || (c1 == c2 && i1 < i2);
 			};
 			
+			std::vector<internal::SelectTask> tasks;
 			for(size_t i_el = 0; i_el < idx.size() - 1; ++i_el) {
-				auto it1 = indirections.begin() + idx[i_el];
-				auto it2 = indirections.begin() + idx[i_el + 1];
+				// Range i_el is split at the inner boundaries of its 'factor' sub-ranges
+				const size_t* b_begin = sub_idx.data() + factor * i_el + 1;
+				const size_t* b_end   = sub_idx.data() + factor * (i_el + 1);
 				
-				std::sort(it1, it2, comparator);
+				if(b_begin != b_end)
+					tasks.push_back(internal::SelectTask{idx[i_el], idx[i_el + 1], b_begin, b_end});
+			}
+			
+			internal::multi_select(indirections, std::move(tasks), comparator);
+			
+			// The leaves are sorted along the last dimension
+			if(i_dim == dim - 1) {
+				parallel::parallel_for(0, sub_idx.size() - 1, [&](size_t i_el) {
+					std::sort(indirections.begin() + sub_idx[i_el], indirections.begin() + sub_idx[i_el + 1], comparator);
+				}, 64);
 			}
 		}
 		
@@ -135,33 +306,28 @@ namespace tinygeo {
 		
 		PackResult<T> result(n_nodes);
 		packprint("Copying output");
-		for(size_t i = 0; i < n_nodes; ++i) {
+		parallel::parallel_for(0, n_nodes, [&](size_t i) {
 			size_t start = last_stage[i];
 			size_t stop  = last_stage[i+1];
 			
 			auto& node = result[i];
 			
-			// Copy the data into the target node
-			{
-				node.data.reserve(stop - start);
-				auto transformer = [&](size_t i) {
-					const PairType& in = storage[i];
-					return in.first;
-				};
-				std::transform(indirections.begin() + start, indirections.begin() + stop, std::back_inserter(node.data), transformer);
-			}
-			
 			// Bounding box computation
 			auto box = Box<P>::empty();
 			for(size_t j = start; j < stop; ++j) {
-				box = combine_boxes(box, storage[indirections[j]].first.bounding_box());
+				box = combine_boxes(box, storage[indirections[j]].bounding_box());
 			}
 			node.box = box;
-		}
+			
+			// Move the data into the target node
+			node.data.reserve(stop - start);
+			for(size_t j = start; j < stop; ++j)
+				node.data.push_back(std::move(storage[indirections[j]]));
+		}, 16);
 		
 		return result;		
 	}
-		
+	
 	/** pack_static only can construct leaf nodes. This class contains the method that pack the
 	 *  nodes holding the data into the correct target. If it is leaf nodes holding data, the target is
 	 *  unchanged. However, if the leaf nodes hold references to other nodes, they are converted into
@@ -172,7 +338,7 @@ namespace tinygeo {
 		
 		/** Simple case: We packed a list of input data */
 		static NodeList convert(PackResult<T>&& in) {
-			return in;
+			return std::move(in);
 		}
 		
 		/** Complex case: We packed a list of nodes. Here, we need to
@@ -196,9 +362,398 @@ namespace tinygeo {
 		
 		NodeList nodes = PackNesting<T>::convert(pack_static(it1, it2, size));
 		while(nodes.size() != 1) {
-			nodes = PackNesting<T>::convert(pack_static(nodes.begin(), nodes.end(), size));
+			nodes = PackNesting<T>::convert(pack_static(std::make_move_iterator(nodes.begin()), std::make_move_iterator(nodes.end()), size));
+		}
+		
+		return std::move(nodes[0]);
+	}
+	
+	/** Tree construction algorithm used by IndexedTriangleMesh::pack */
+	enum class PackStrategy {
+		str, //!< Sort-tile-recursive packing based on the bounding box centers (pack)
+		sah, //!< Binned surface area heuristic (pack_sah)
+		lbvh //!< Linear BVH over the Morton codes of the bounding box centers (pack_lbvh)
+	};
+	
+	/** Cost model for the surface area heuristic. Every visited node costs one box test per child and
+	 *  one primitive test per data element. */
+	struct SAHCosts {
+		double box = 1;
+		double data = 1;
+	};
+	
+	namespace internal {
+		template<typename T>
+		struct SAHBuilder {
+			using P = point_for<typename T::Point>;
+			using B = Box<P>;
+			static constexpr size_t dim = P::dimension;
+			static constexpr size_t n_bins = 16;
+			
+			struct Item {
+				T value;
+				B box;
+				P center;
+			};
+			
+			std::vector<Item> items;
+			size_t leaf_size;
+			SAHCosts costs;
+			
+			PackNode<T> build(size_t begin, size_t end) {
+				PackNode<T> node;
+				
+				// Compute node and center bounding boxes
+				B box = B::empty();
+				B cbox = B::empty();
+				for(size_t i = begin; i < end; ++i) {
+					box = combine_boxes(box, items[i].box);
+					cbox = combine_boxes(cbox, B(items[i].center, items[i].center));
+				}
+				node.box = box;
+				
+				const size_t count = end - begin;
+				const double area = half_area(box);
+				
+				// Find the cheapest binned split plane over all dimensions
+				double best_cost = std::numeric_limits<double>::infinity();
+				size_t best_dim = dim;
+				size_t best_bin = 0;
+				
+				for(size_t d = 0; d < dim && count > 1; ++d) {
+					const double low = cbox.min()[d];
+					const double extent = cbox.max()[d] - low;
+					
+					if(!(extent > 0))
+						continue;
+					
+					std::array<B, n_bins> bin_boxes;
+					std::array<size_t, n_bins> bin_counts;
+					bin_boxes.fill(B::empty());
+					bin_counts.fill(0);
+					
+					for(size_t i = begin; i < end; ++i) {
+						const size_t b = bin_for(items[i].center[d], low, extent);
+						bin_boxes[b] = combine_boxes(bin_boxes[b], items[i].box);
+						++bin_counts[b];
+					}
+					
+					// Sweep from the right to obtain the area of all right-hand sides
+					std::array<double, n_bins> right_area;
+					{
+						B acc = B::empty();
+						for(size_t b = n_bins - 1; b > 0; --b) {
+							acc = combine_boxes(acc, bin_boxes[b]);
+							right_area[b] = half_area(acc);
+						}
+					}
+					
+					// Sweep from the left and evaluate the split between bins b - 1 and b
+					B acc = B::empty();
+					size_t n_left = 0;
+					for(size_t b = 1; b < n_bins; ++b) {
+						acc = combine_boxes(acc, bin_boxes[b - 1]);
+						n_left += bin_counts[b - 1];
+						
+						if(n_left == 0 || n_left == count)
+							continue;
+						
+						const double cost = 2 * costs.box + costs.data * (half_area(acc) * n_left + right_area[b] * (count - n_left)) / area;
+						if(cost < best_cost) {
+							best_cost = cost;
+							best_dim = d;
+							best_bin = b;
+						}
+					}
+				}
+				
+				// Turn the node into a leaf if that is cheaper and permitted
+				const double leaf_cost = costs.data * count;
+				if(count <= 1 || (count <= leaf_size && leaf_cost <= best_cost)) {
+					node.data.reserve(count);
+					for(size_t i = begin; i < end; ++i)
+						node.data.push_back(items[i].value);
+					
+					return node;
+				}
+				
+				// Partition the items
+				size_t mid;
+				if(best_dim < dim) {
+					const double low = cbox.min()[best_dim];
+					const double extent = cbox.max()[best_dim] - low;
+					
+					auto pred = [&, this](const Item& item) { return bin_for(item.center[best_dim], low, extent) < best_bin; };
+					mid = std::partition(items.begin() + begin, items.begin() + end, pred) - items.begin();
+				} else {
+					// All centers coincide, so no split is better than any other
+					mid = begin + count / 2;
+				}
+				
+				node.children.reserve(2);
+				node.children.push_back(build(begin, mid));
+				node.children.push_back(build(mid, end));
+				
+				return node;
+			}
+			
+			static size_t bin_for(double x, double low, double extent) {
+				const size_t b = (size_t) (n_bins * ((x - low) / extent));
+				return b < n_bins ? b : n_bins - 1;
+			}
+		};
+	}
+	
+	/** Builds a binary tree by recursive binned surface area heuristic (SAH) splitting. In contrast to pack, this
+	 *  takes the extent of the elements into account. Nodes with at most leaf_size elements become leaves when
+	 *  this is cheaper than the best split. */
+	template<typename It1, typename It2>
+	PackNode<typename It1::value_type> pack_sah(It1 begin, It2 end, size_t leaf_size, SAHCosts costs = SAHCosts()) {
+		using T = typename It1::value_type;
+		using Builder = internal::SAHBuilder<T>;
+		
+		Builder builder;
+		builder.leaf_size = leaf_size;
+		builder.costs = costs;
+		
+		for(It1 it = begin; it != end; ++it) {
+			const T& value = *it;
+			const auto box = value.bounding_box();
+			builder.items.push_back(typename Builder::Item{value, box, center(box)});
+		}
+		
+		return builder.build(0, builder.items.size());
+	}
+	
+	namespace internal {
+		// Number of leading zero bits, 64 for x == 0
+		inline int leading_zeros(std::uint64_t x) {
+			if(x == 0)
+				return 64;
+			
+			#if defined(__GNUC__) || defined(__clang__)
+				return __builtin_clzll(x);
+			#else
+				int result = 0;
+				for(int shift = 32; shift > 0; shift /= 2) {
+					if(x >> (64 - shift) == 0) {
+						result += shift;
+						x <<= shift;
+					}
+				}
+				
+				return result;
+			#endif
 		}
 		
-		return nodes[0];
+		template<typename T>
+		struct LBVHBuilder {
+			using P = point_for<typename T::Point>;
+			using B = Box<P>;
+			static constexpr size_t dim = P::dimension;
+			
+			// Internal node of the binary radix tree, covering the sorted elements [first, last]. Its children
+			// cover [first, split] and [split + 1, last].
+			struct Internal {
+				size_t first;
+				size_t last;
+				size_t split;
+			};
+			
+			// Subtree of the radix tree. Ranges with more than one element are internal node 'id'.
+			struct Range {
+				size_t first;
+				size_t last;
+				size_t id;
+				
+				size_t count() const { return last - first + 1; }
+			};
+			
+			std::vector<T> items;
+			std::vector<B> boxes;
+			std::vector<std::uint64_t> codes;
+			std::vector<Internal> nodes;
+			
+			size_t leaf_size;
+			size_t fan_out;
+			
+			// Length of the common prefix of the keys of elements i and j, -1 if j is out of range. Equal codes are
+			// distinguished by the element positions.
+			int delta(std::ptrdiff_t i, std::ptrdiff_t j) const {
+				if(j < 0 || j >= (std::ptrdiff_t) codes.size())
+					return -1;
+				
+				if(codes[i] == codes[j])
+					return 64 + leading_zeros((std::uint64_t) (i ^ j));
+				
+				return leading_zeros(codes[i] ^ codes[j]);
+			}
+			
+			// Determines the range and split of internal node i from the sorted codes alone (Karras 2012), so all
+			// nodes can be computed independently
+			Internal find_node(std::ptrdiff_t i) const {
+				const std::ptrdiff_t d = delta(i, i + 1) > delta(i, i - 1) ? 1 : -1;
+				const int delta_min = delta(i, i - d);
+				
+				// Upper bound for the length of the range, then binary search for the other end
+				std::ptrdiff_t l_max = 2;
+				while(delta(i, i + l_max * d) > delta_min)
+					l_max *= 2;
+				
+				std::ptrdiff_t l = 0;
+				for(std::ptrdiff_t t = l_max / 2; t >= 1; t /= 2) {
+					if(delta(i, i + (l + t) * d) > delta_min)
+						l += t;
+				}
+				
+				const std::ptrdiff_t j = i + l * d;
+				const int delta_node = delta(i, j);
+				
+				// Binary search for the position of the highest differing bit within the range
+				std::ptrdiff_t s = 0;
+				std::ptrdiff_t t = l;
+				do {
+					t = (t + 1) / 2;
+					if(delta(i, i + (s + t) * d) > delta_node)
+						s += t;
+				} while(t > 1);
+				
+				const std::ptrdiff_t split = i + s * d + std::min(d, (std::ptrdiff_t) 0);
+				return Internal{(size_t) std::min(i, j), (size_t) std::max(i, j), (size_t) split};
+			}
+			
+			void children(const Range& range, std::vector<Range>& out) const {
+				const Internal& node = nodes[range.id];
+				
+				out.push_back(Range{node.first, node.split, node.split});
+				out.push_back(Range{node.split + 1, node.last, node.split + 1});
+			}
+			
+			PackNode<T> build(const Range& range) {
+				PackNode<T> node;
+				node.box = B::empty();
+				
+				if(range.count() <= leaf_size) {
+					node.data.reserve(range.count());
+					for(size_t i = range.first; i <= range.last; ++i) {
+						node.box = combine_boxes(node.box, boxes[i]);
+						node.data.push_back(std::move(items[i]));
+					}
+					
+					return node;
+				}
+				
+				// Collapse the binary tree into nodes with up to fan_out children by repeatedly splitting the
+				// largest child that is too large to become a leaf
+				std::vector<Range> ranges;
+				children(range, ranges);
+				
+				while(ranges.size() < fan_out) {
+					auto largest = std::max_element(ranges.begin(), ranges.end(), [](const Range& r1, const Range& r2) { return r1.count() < r2.count(); });
+					
+					if(largest -> count() <= leaf_size)
+						break;
+					
+					std::vector<Range> split;
+					children(*largest, split);
+					
+					*largest = split[1];
+					ranges.insert(largest, split[0]);
+				}
+				
+				node.children.reserve(ranges.size());
+				for(const Range& child : ranges) {
+					node.children.push_back(build(child));
+					node.box = combine_boxes(node.box, node.children.back().box);
+				}
+				
+				return node;
+			}
+		};
+	}
+	
+	/** Builds a linear bounding volume hierarchy: The elements are sorted along the Morton curve of their
+	 *  bounding box centers (10 bits per axis in 3D) with a radix sort, and the hierarchy follows from the
+	 *  common prefixes of the sorted codes. The binary radix tree is computed in parallel and collapsed into
+	 *  nodes with up to 'size' children and leaves with up to 'size' elements. Builds faster than pack and
+	 *  much faster than pack_sah, with a tree quality (see sah_cost) usually between the two. */
+	template<typename It1, typename It2>
+	PackNode<typename It1::value_type> pack_lbvh(It1 begin, It2 end, size_t size) {
+		using T = typename It1::value_type;
+		using Builder = internal::LBVHBuilder<T>;
+		using B = typename Builder::B;
+		using P = typename Builder::P;
+		
+		std::vector<T> storage;
+		for(It1 it = begin; it != end; ++it)
+			storage.push_back(*it);
+		
+		const size_t n = storage.size();
+		
+		Builder builder;
+		builder.leaf_size = std::max(size, (size_t) 1);
+		builder.fan_out = std::max(size, (size_t) 2);
+		
+		std::vector<B> boxes(n);
+		std::vector<P> centers(n);
+		parallel::parallel_for(0, n, [&](size_t i) {
+			boxes[i] = storage[i].bounding_box();
+			centers[i] = center(boxes[i]);
+		}, 1024);
+		
+		B center_box = B::empty();
+		for(const P& c : centers)
+			center_box = combine_boxes(center_box, B(c, c));
+		
+		builder.codes.resize(n);
+		parallel::parallel_for(0, n, [&](size_t i) {
+			builder.codes[i] = morton_code(centers[i], center_box, 30 / Builder::dim);
+		}, 1024);
+		
+		const std::vector<size_t> order = internal::sort_order(builder.codes);
+		
+		builder.items.reserve(n);
+		builder.boxes.reserve(n);
+		for(size_t i : order) {
+			builder.items.push_back(std::move(storage[i]));
+			builder.boxes.push_back(boxes[i]);
+		}
+		
+		if(n == 0) {
+			PackNode<T> result;
+			result.box = B::empty();
+			return result;
+		}
+		
+		builder.nodes.resize(n - 1);
+		parallel::parallel_for(0, n - 1, [&](size_t i) {
+			builder.nodes[i] = builder.find_node(i);
+		}, 1024);
+		
+		return builder.build(typename Builder::Range{0, n - 1, 0});
+	}
+	
+	namespace internal {
+		template<typename N>
+		double sah_cost_sum(const N& node, const SAHCosts& costs) {
+			double result = half_area(node.bounding_box()) * (costs.box * node.n_children() + costs.data * node.n_data());
+			
+			for(size_t i = 0; i < node.n_children(); ++i)
+				result += sah_cost_sum(node.child(i), costs);
+			
+			return result;
+		}
+	}
+	
+	/** Computes the expected cost of tracing a random ray through the tree under the cost model of
+	 *  SAHCosts, normalized to the cost of a ray hitting the root node */
+	template<typename N>
+	double sah_cost(const N& node, SAHCosts costs = SAHCosts()) {
+		const double root_area = half_area(node.bounding_box());
+		
+		if(!(root_area > 0))
+			return costs.box * node.n_children() + costs.data * node.n_data();
+		
+		return internal::sah_cost_sum(node, costs) / root_area;
 	}
-}
\ No newline at end of file
+}
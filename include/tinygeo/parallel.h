@@ -0,0 +1,319 @@
+#pragma once
+
+#include <vector>
+#include <thread>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <exception>
+#include <algorithm>
+
+#if !_WIN32
+#include <unistd.h>
+#endif
+
+namespace tinygeo {
+
+namespace parallel {
+
+namespace internal {
+	// Requested thread count. 0 selects the hardware concurrency.
+	inline std::atomic<size_t>& thread_setting() {
+		static std::atomic<size_t> value(0);
+		return value;
+	}
+	
+	// Set while the current thread executes work of a parallel loop. Nested loops then run serially.
+	inline bool& in_worker() {
+		static thread_local bool value = false;
+		return value;
+	}
+	
+	struct WorkerScope {
+		bool previous;
+		
+		WorkerScope() : previous(in_worker()) { in_worker() = true; }
+		~WorkerScope() { in_worker() = previous; }
+	};
+	
+	/** Persistent worker threads. run() executes a job on the calling thread (participant 0) and on
+	 *  participants 1 ... n - 1 of the pool, and returns once all of them are done. The pool runs one job
+	 *  at a time, callers hold 'busy' while they use it. */
+	class ThreadPool {
+	public:
+		std::mutex busy;
+		
+		ThreadPool() = default;
+		ThreadPool(const ThreadPool&) = delete;
+		ThreadPool& operator=(const ThreadPool&) = delete;
+		
+		~ThreadPool() { stop(); }
+		
+		size_t size() const { return workers.size(); }
+		
+		// Requires 'busy'
+		void resize(size_t n) {
+			if(n == workers.size())
+				return;
+			
+			stop();
+			
+			std::lock_guard<std::mutex> lock(mutex);
+			stopping = false;
+			
+			// New workers wait for the next job, even if they only get to run after it was posted
+			const size_t start = generation;
+			
+			workers.reserve(n);
+			for(size_t i = 0; i < n; ++i)
+				workers.emplace_back([this, i, start]() { work(i + 1, start); });
+		}
+		
+		// Requires 'busy' and 1 <= n_participants <= size() + 1. The job must not throw.
+		template<typename F>
+		void run(size_t n_participants, F& job) {
+			{
+				std::lock_guard<std::mutex> lock(mutex);
+				
+				call = [](void* context, size_t participant) { (*static_cast<F*>(context))(participant); };
+				context = &job;
+				participants = n_participants;
+				n_running = n_participants - 1;
+				++generation;
+			}
+			
+			wake.notify_all();
+			job(0);
+			
+			std::unique_lock<std::mutex> lock(mutex);
+			done.wait(lock, [this]() { return n_running == 0; });
+		}
+		
+		// Pools do not survive fork(), the child only has the forking thread
+		bool owned_by_process() const {
+			#if _WIN32
+			return true;
+			#else
+			return owner == getpid();
+			#endif
+		}
+	
+	private:
+		std::vector<std::thread> workers;
+		
+		std::mutex mutex;
+		std::condition_variable wake;
+		std::condition_variable done;
+		
+		// Current job, guarded by mutex
+		void (*call)(void*, size_t) = nullptr;
+		void* context = nullptr;
+		size_t participants = 0;
+		size_t n_running = 0;
+		size_t generation = 0;
+		bool stopping = false;
+		
+		#if !_WIN32
+		const pid_t owner = getpid();
+		#endif
+		
+		void work(size_t participant, size_t seen) {
+			in_worker() = true;
+			
+			std::unique_lock<std::mutex> lock(mutex);
+			
+			while(true) {
+				wake.wait(lock, [&]() { return stopping || generation != seen; });
+				if(stopping)
+					return;
+				
+				seen = generation;
+				if(participant >= participants)
+					continue;
+				
+				lock.unlock();
+				call(context, participant);
+				lock.lock();
+				
+				if(--n_running == 0)
+					done.notify_all();
+			}
+		}
+		
+		void stop() {
+			{
+				std::lock_guard<std::mutex> lock(mutex);
+				stopping = true;
+			}
+			
+			wake.notify_all();
+			for(auto& t : workers)
+				t.join();
+			
+			workers.clear();
+		}
+	};
+	
+	// Shared pool, created on first use. It is never destroyed, because joining threads during static
+	// destruction can deadlock (e.g. when the Python module is unloaded on Windows). A child process
+	// created by fork() replaces the pool of its parent.
+	inline ThreadPool& pool() {
+		static std::atomic<ThreadPool*> instance(nullptr);
+		
+		ThreadPool* current = instance.load();
+		if(current != nullptr && current -> owned_by_process())
+			return *current;
+		
+		ThreadPool* created = new ThreadPool();
+		if(instance.compare_exchange_strong(current, created))
+			return *created;
+		
+		// Another thread installed a pool first
+		delete created;
+		return *current;
+	}
+	
+	// Chunks [front, back) of a parallel loop that are not taken yet. Each participant takes chunks from the
+	// front of its own range and steals from the back of the others once it runs out.
+	struct WorkRange {
+		std::mutex mutex;
+		size_t front = 0;
+		size_t back = 0;
+	};
+	
+	// Next chunk for participant p. Steals half of the remaining chunks of another participant if p has
+	// none left. Returns false once all ranges are empty.
+	inline bool next_chunk(std::vector<WorkRange>& ranges, size_t p, size_t& chunk) {
+		{
+			std::lock_guard<std::mutex> lock(ranges[p].mutex);
+			if(ranges[p].front < ranges[p].back) {
+				chunk = ranges[p].front++;
+				return true;
+			}
+		}
+		
+		for(size_t k = 1; k < ranges.size(); ++k) {
+			WorkRange& victim = ranges[(p + k) % ranges.size()];
+			
+			size_t stolen_front;
+			size_t stolen_back;
+			
+			{
+				std::lock_guard<std::mutex> lock(victim.mutex);
+				if(victim.front >= victim.back)
+					continue;
+				
+				stolen_back = victim.back;
+				stolen_front = victim.back - (victim.back - victim.front + 1) / 2;
+				victim.back = stolen_front;
+			}
+			
+			chunk = stolen_front;
+			
+			std::lock_guard<std::mutex> lock(ranges[p].mutex);
+			ranges[p].front = stolen_front + 1;
+			ranges[p].back = stolen_back;
+			
+			return true;
+		}
+		
+		return false;
+	}
+}
+
+/** Number of threads used by the parallel algorithms of this library */
+inline size_t num_threads() {
+	size_t result = internal::thread_setting();
+	
+	if(result == 0)
+		result = std::thread::hardware_concurrency();
+	
+	return result == 0 ? 1 : result;
+}
+
+/** Sets the number of threads used by the parallel algorithms. 0 selects the hardware concurrency. The
+ *  thread pool is resized right away, after the loop that currently uses it (if any) has finished. */
+inline void set_num_threads(size_t n) {
+	internal::thread_setting() = n;
+	
+	if(internal::in_worker())
+		return;
+	
+	internal::ThreadPool& pool = internal::pool();
+	std::lock_guard<std::mutex> lock(pool.busy);
+	pool.resize(num_threads() - 1);
+}
+
+/** Calls f(i) for all i in [begin, end) on the threads of a persistent pool. The indices are split into
+ *  chunks of size grain, and every thread starts on a contiguous share of the chunks. Threads that finish
+ *  early steal half of the remaining chunks of another thread. Calls from within a parallel loop, and
+ *  calls made while another thread's loop occupies the pool, are executed serially on the calling
+ *  thread. The first exception thrown by f is rethrown once all threads have stopped. */
+template<typename F>
+void parallel_for(size_t begin, size_t end, F&& f, size_t grain = 1) {
+	if(end <= begin)
+		return;
+	
+	if(grain == 0)
+		grain = 1;
+	
+	auto serial = [&]() {
+		for(size_t i = begin; i < end; ++i)
+			f(i);
+	};
+	
+	const size_t n_chunks = (end - begin + grain - 1) / grain;
+	size_t n_threads = std::min(num_threads(), n_chunks);
+	
+	if(n_threads <= 1 || internal::in_worker())
+		return serial();
+	
+	internal::ThreadPool& pool = internal::pool();
+	std::unique_lock<std::mutex> busy(pool.busy, std::try_to_lock);
+	
+	if(!busy.owns_lock())
+		return serial();
+	
+	pool.resize(num_threads() - 1);
+	n_threads = std::min(n_threads, pool.size() + 1);
+	
+	std::vector<internal::WorkRange> ranges(n_threads);
+	for(size_t p = 0; p < n_threads; ++p) {
+		ranges[p].front = n_chunks * p / n_threads;
+		ranges[p].back = n_chunks * (p + 1) / n_threads;
+	}
+	
+	std::atomic<bool> failed(false);
+	std::exception_ptr error;
+	std::mutex error_mutex;
+	
+	auto work = [&](size_t p) {
+		internal::WorkerScope scope;
+		
+		size_t chunk;
+		while(!failed && internal::next_chunk(ranges, p, chunk)) {
+			const size_t chunk_begin = begin + chunk * grain;
+			const size_t chunk_end = std::min(chunk_begin + grain, end);
+			
+			try {
+				for(size_t i = chunk_begin; i < chunk_end; ++i)
+					f(i);
+			} catch(...) {
+				std::lock_guard<std::mutex> lock(error_mutex);
+				if(!error)
+					error = std::current_exception();
+				
+				failed = true;
+			}
+		}
+	};
+	
+	pool.run(n_threads, work);
+	
+	if(error)
+		std::rethrow_exception(error);
+}
+
+}
+
+}
@@ -0,0 +1,179 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <vector>
+
+#include <tinygeo/concepts.h>
+#include <tinygeo/distance.h>
+
+namespace tinygeo {
+
+/** Whether two boxes overlap. Touching boxes count as overlapping. */
+template<typename B1, typename B2>
+bool boxes_overlap(const B1& b1, const B2& b2) {
+	for(size_t i = 0; i < B1::Point::dimension; ++i) {
+		if(b1.max()[i] < b2.min()[i] || b2.max()[i] < b1.min()[i])
+			return false;
+	}
+	
+	return true;
+}
+
+namespace internal {
+	// Separating axis test between the triangle (v0, v1, v2) and the box centered at the origin with half
+	// extents h (Akenine-Moeller). The candidate axes are the box normals, the triangle normal and the cross
+	// products of the triangle edges with the box normals.
+	template<typename Num>
+	bool triangle_box_overlap(const Num (&v)[3][3], const Num* h) {
+		const Num e[3][3] = {
+			{v[1][0] - v[0][0], v[1][1] - v[0][1], v[1][2] - v[0][2]},
+			{v[2][0] - v[1][0], v[2][1] - v[1][1], v[2][2] - v[1][2]},
+			{v[0][0] - v[2][0], v[0][1] - v[2][1], v[0][2] - v[2][2]}
+		};
+		
+		// Edge cross box normal axes
+		for(size_t i = 0; i < 3; ++i) {
+			for(size_t j = 0; j < 3; ++j) {
+				// axis = e_i x unit_j
+				Num axis[3] = {0, 0, 0};
+				axis[(j + 1) % 3] =  e[i][(j + 2) % 3];
+				axis[(j + 2) % 3] = -e[i][(j + 1) % 3];
+				
+				Num p_min = std::numeric_limits<Num>::infinity();
+				Num p_max = -p_min;
+				for(size_t k = 0; k < 3; ++k) {
+					const Num proj = dot3(axis, v[k]);
+					p_min = std::min(p_min, proj);
+					p_max = std::max(p_max, proj);
+				}
+				
+				const Num r = h[0] * std::abs(axis[0]) + h[1] * std::abs(axis[1]) + h[2] * std::abs(axis[2]);
+				if(p_min > r || p_max < -r)
+					return false;
+			}
+		}
+		
+		// Box normals
+		for(size_t d = 0; d < 3; ++d) {
+			const Num p_min = std::min(v[0][d], std::min(v[1][d], v[2][d]));
+			const Num p_max = std::max(v[0][d], std::max(v[1][d], v[2][d]));
+			
+			if(p_min > h[d] || p_max < -h[d])
+				return false;
+		}
+		
+		// Triangle normal
+		const Num n[3] = {
+			e[0][1] * e[1][2] - e[0][2] * e[1][1],
+			e[0][2] * e[1][0] - e[0][0] * e[1][2],
+			e[0][0] * e[1][1] - e[0][1] * e[1][0]
+		};
+		
+		const Num dist = dot3(n, v[0]);
+		const Num r = h[0] * std::abs(n[0]) + h[1] * std::abs(n[1]) + h[2] * std::abs(n[2]);
+		
+		return std::abs(dist) <= r;
+	}
+	
+	// Calls visit(data(i)) for all triangles stored below node whose node boxes satisfy accept_box
+	template<typename N, typename F1, typename F2>
+	void visit_nodes(const N& node, F1&& accept_box, F2&& visit) {
+		TraversalStack<N, 256> stack;
+		stack.push(node);
+		
+		while(!stack.empty()) {
+			const N current = stack.pop();
+			
+			for(size_t i = 0; i < current.n_data(); ++i)
+				visit(current.data(i));
+			
+			for(size_t i = 0; i < current.n_children(); ++i) {
+				const N child = current.child(i);
+				
+				if(accept_box(child.bounding_box()))
+					stack.push(child);
+			}
+		}
+	}
+}
+
+/** Whether a triangle intersects a box. Triangles touching the box count as intersecting. */
+template<typename T, typename B>
+std::enable_if_t<T::tag == tags::triangle && T::Point::dimension == 3, bool> intersects_box(const T& tri, const B& box) {
+	using P = point_for<typename T::Point>;
+	using Num = typename P::numeric_type;
+	
+	const P points[3] = {tri.template get<0>(), tri.template get<1>(), tri.template get<2>()};
+	
+	Num v[3][3];
+	Num h[3];
+	for(size_t d = 0; d < 3; ++d) {
+		const Num c = (box.min()[d] + box.max()[d]) / 2;
+		h[d] = (box.max()[d] - box.min()[d]) / 2;
+		
+		for(size_t k = 0; k < 3; ++k)
+			v[k][d] = points[k][d] - c;
+	}
+	
+	return internal::triangle_box_overlap(v, h);
+}
+
+/** Whether a triangle intersects the closed ball of the given radius around center */
+template<typename T>
+std::enable_if_t<T::tag == tags::triangle && T::Point::dimension == 3, bool> intersects_sphere(
+	const T& tri,
+	const point_for<typename T::Point>& center,
+	typename T::Point::numeric_type radius
+) {
+	return internal::closest_point_squared(center, tri).distance <= radius * radius;
+}
+
+/** Appends the indices of all triangles below node that intersect the box to out, in ascending order */
+template<typename N, typename B>
+std::enable_if_t<N::tag == tags::node> query_box(const N& node, const B& box, std::vector<size_t>& out) {
+	const size_t begin = out.size();
+	
+	if(is_empty(box) || !boxes_overlap(node.bounding_box(), box))
+		return;
+	
+	internal::visit_nodes(
+		node,
+		[&](const auto& node_box) { return boxes_overlap(node_box, box); },
+		[&](const auto& tri) {
+			if(boxes_overlap(tri.bounding_box(), box) && intersects_box(tri, box))
+				out.push_back(internal::triangle_index(tri, 0));
+		}
+	);
+	
+	std::sort(out.begin() + begin, out.end());
+}
+
+/** Appends the indices of all triangles below node that intersect the ball around center to out, in
+ *  ascending order */
+template<typename N>
+std::enable_if_t<N::tag == tags::node> query_sphere(
+	const N& node,
+	const point_for<typename N::Point>& center,
+	typename N::Point::numeric_type radius,
+	std::vector<size_t>& out
+) {
+	const size_t begin = out.size();
+	const auto r2 = radius * radius;
+	
+	if(radius < 0 || box_distance_squared(center, node.bounding_box()) > r2)
+		return;
+	
+	internal::visit_nodes(
+		node,
+		[&](const auto& node_box) { return box_distance_squared(center, node_box) <= r2; },
+		[&](const auto& tri) {
+			if(intersects_sphere(tri, center, radius))
+				out.push_back(internal::triangle_index(tri, 0));
+		}
+	);
+	
+	std::sort(out.begin() + begin, out.end());
+}
+
+}
@@ -1,42 +1,56 @@
 #pragma once
 
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include <new>
+#include <vector>
+
 #include <tinygeo/concepts.h>
 #include <tinygeo/buffer.h>
-#include <Eigen/Dense>
 
 namespace tinygeo {
 	
-template<typename Num, typename Tag>
+/** Closest hit along a segment. During traversal only the index of the hit triangle is recorded. Its
+ *  tags can be looked up afterwards (see TriangleMesh::tags). */
+template<typename Num>
 struct RaytraceResult {
+	static constexpr size_t no_hit = std::numeric_limits<size_t>::max();
+	
 	Num lambda;
-	std::vector<Tag> tags;
+	size_t index;
 	
 	RaytraceResult() :
 		lambda(std::numeric_limits<Num>::infinity()),
-		tags()
+		index(no_hit)
 	{}
 	
-	RaytraceResult(Num lambda, const std::vector<Tag>& tags = std::vector<Tag>()) :
+	RaytraceResult(Num lambda, size_t index = no_hit) :
 		lambda(lambda),
-		tags(tags)
+		index(index)
 	{}
 	
-	void combine(const RaytraceResult<Num, Tag>& other) {
+	bool hit() const { return lambda < std::numeric_limits<Num>::infinity(); }
+	
+	void combine(const RaytraceResult<Num>& other) {
 		if(other.lambda >= lambda)
 			return;
 		
 		lambda = other.lambda;
-		tags = other.tags;
+		index = other.index;
 	}
 	
-	RaytraceResult<Num, Tag>& operator<<(const RaytraceResult<Num, Tag>& other) {
+	RaytraceResult<Num>& operator<<(const RaytraceResult<Num>& other) {
 		combine(other);
 		return *this;
 	}
 };
 
+template<typename Num>
+constexpr size_t RaytraceResult<Num>::no_hit;
+
 template<typename X>
-using raytrace_result_for = RaytraceResult<typename X::Point::numeric_type, typename X::tag_type>;
+using raytrace_result_for = RaytraceResult<typename X::Point::numeric_type>;
 
 template<typename X, bool enif>
 using conditional_raytrace = std::enable_if_t<enif, raytrace_result_for<X>>;
@@ -47,6 +61,90 @@ struct same_type { using type = T; };
 template<typename T>
 using same_type_t = typename same_type<T>::type;
 
+namespace internal {
+	// A stack that lives in local storage up to a fixed capacity and only spills onto the heap beyond it.
+	// Elements only need to be copy-constructible.
+	template<typename T, size_t capacity>
+	struct TraversalStack {
+		std::aligned_storage_t<sizeof(T), alignof(T)> local[capacity];
+		size_t n_local = 0;
+		std::vector<T> spill;
+		
+		TraversalStack() = default;
+		TraversalStack(const TraversalStack&) = delete;
+		TraversalStack& operator=(const TraversalStack&) = delete;
+		
+		~TraversalStack() {
+			while(n_local > 0)
+				at(--n_local).~T();
+		}
+		
+		bool empty() const { return n_local == 0 && spill.empty(); }
+		
+		void push(const T& t) {
+			if(n_local < capacity)
+				new (&local[n_local++]) T(t);
+			else
+				spill.push_back(t);
+		}
+		
+		T pop() {
+			if(!spill.empty()) {
+				T result = spill.back();
+				spill.pop_back();
+				return result;
+			}
+			
+			T& top = at(--n_local);
+			T result(std::move(top));
+			top.~T();
+			
+			return result;
+		}
+		
+	private:
+		T& at(size_t i) { return *reinterpret_cast<T*>(&local[i]); }
+	};
+	
+	// Direct-mapped cache of recently intersected triangles. Triangles overlapping several grid cells are
+	// met again in neighbouring cells, so a small cache catches most repeated tests.
+	struct Mailbox {
+		static constexpr size_t n_slots = 32;
+		
+		size_t slots[n_slots];
+		
+		Mailbox() {
+			for(size_t i = 0; i < n_slots; ++i)
+				slots[i] = std::numeric_limits<size_t>::max();
+		}
+		
+		// Returns true if idx was not seen recently and records it
+		bool check(size_t idx) {
+			size_t& slot = slots[idx % n_slots];
+			
+			if(slot == idx)
+				return false;
+			
+			slot = idx;
+			return true;
+		}
+	};
+	
+	// Sorts the first n entries of a small array of (distance, index) pairs in descending order of distance
+	template<typename Num>
+	void sort_descending(std::pair<Num, size_t>* data, size_t n) {
+		for(size_t i = 1; i < n; ++i) {
+			const std::pair<Num, size_t> value = data[i];
+			
+			size_t j = i;
+			for(; j > 0 && data[j - 1].first < value.first; --j)
+				data[j] = data[j - 1];
+			
+			data[j] = value;
+		}
+	}
+}
+
 template<typename N>
 conditional_raytrace<N, N::tag == tags::node> ray_trace(
 	const point_for<typename N::Point>& start,
@@ -55,69 +153,171 @@ conditional_raytrace<N, N::tag == tags::node> ray_trace(
 	typename N::Point::numeric_type l_max
 ) {
 	using Num = typename N::Point::numeric_type;
-	using Tag = typename N::tag_type;
 	using PairType = std::pair<Num, size_t>;
 	
-	//pybind11::print("Casting ray through node");
-	//pybind11::print("  with " + std::to_string(node.n_data()) + " triangles");
-	//pybind11::print("  with " + std::to_string(node.n_children()) + " children");
-	
-	// Intersect with stored triangles
-	//Num result = std::numeric_limits<Num>::infinity();
-	RaytraceResult<Num, Tag> result;
-	{
-		std::vector<PairType> data;
-		data.reserve(node.n_data());
-		for(size_t i = 0; i < node.n_data(); ++i)
-			data.push_back(std::make_pair(ray_trace(start, end, node.data(i).bounding_box(), l_max).lambda, i));
-		
-		std::sort(data.begin(), data.end());
-		
-		for(size_t i = 0; i < data.size(); ++i) {
-			if(data[i].first < std::min(result.lambda, l_max)) {
-				/*Num it_result = ray_trace(start, end, node.data(data[i].second), l_max);
-				result = std::min(result, it_result);*/
-				result << ray_trace(start, end, node.data(data[i].second), l_max);
-			} else {
+	// Children are sorted by distance in a local buffer. Nodes with more children are visited unsorted.
+	constexpr size_t max_sorted = 64;
+	
+	struct StackEntry {
+		Num distance;
+		N node;
+	};
+	
+	RaytraceResult<Num> result;
+	internal::TraversalStack<StackEntry, 256> stack;
+	
+	auto visit = [&](const N& current) {
+		// Intersect with stored triangles
+		for(size_t i = 0; i < current.n_data(); ++i)
+			result << ray_trace(start, end, current.data(i), l_max);
+		
+		// Compute lower bound on distance based on bounding box intersections
+		const size_t n_children = current.n_children();
+		PairType hits[max_sorted];
+		size_t n_hits = 0;
+		
+		for(size_t i = 0; i < n_children; ++i) {
+			const N child = current.child(i);
+			const Num distance = ray_trace(start, end, child.bounding_box(), l_max).lambda;
+			
+			if(!(distance < std::min(result.lambda, l_max)))
 				continue;
-			}
+			
+			if(n_children <= max_sorted)
+				hits[n_hits++] = PairType(distance, i);
+			else
+				stack.push(StackEntry{distance, child});
 		}
-	}
+		
+		// Push the farthest child first, so that the closest one is processed next
+		internal::sort_descending(hits, n_hits);
+		for(size_t i = 0; i < n_hits; ++i)
+			stack.push(StackEntry{hits[i].first, current.child(hits[i].second)});
+	};
 	
-	//pybind11::print("  after children, result is " + std::to_string(result));
+	visit(node);
 	
-	// Compute lower bound on distance based on bounding box intersections
-	{
-		std::vector<PairType> data;
-		data.reserve(node.n_children());
-		for(size_t i = 0; i < node.n_children(); ++i)
-			data.push_back(std::make_pair(ray_trace(start, end, node.child(i).bounding_box(), l_max).lambda, i));
+	while(!stack.empty()) {
+		const StackEntry entry = stack.pop();
+		
+		// Skip nodes that can not contain a closer hit anymore
+		if(!(entry.distance < std::min(result.lambda, l_max)))
+			continue;
+		
+		visit(entry.node);
+	}
+	
+	return result;
+}
+
+namespace internal {
+	// Walks the cells of a grid crossed by the segment in order (Amanatides-Woo). visit(cell, t_exit) is called
+	// with the index of every cell and the segment parameter at which it is left, and returns true to stop.
+	template<typename G, typename F>
+	void walk_grid(
+		const point_for<typename G::Point>& start,
+		const point_for<typename G::Point>& end,
+		const G& grid,
+		typename G::Point::numeric_type l_max,
+		F&& visit
+	) {
+		using P = typename G::Point;
+		using Num = typename P::numeric_type;
+		constexpr size_t dim = P::dimension;
 		
-		std::sort(data.begin(), data.end());
+		using MultiIndex = typename G::MultiIndex;
 		
-		for(size_t i = 0; i < node.n_children(); ++i) {
-			//pybind11::print("  Intersection with bounding box " + std::to_string(data[i].second) + ": " + std::to_string(data[i].first));
+		const Num inf = std::numeric_limits<Num>::infinity();
+		const Num tol = 5 * std::numeric_limits<Num>::epsilon();
+		
+		const auto bb = grid.bounding_box();
+		if(is_empty(bb))
+			return;
+		
+		const point_for<P> lo = bb.min();
+		const point_for<P> hi = bb.max();
+		
+		// Clip the segment against the grid box
+		Num t_begin = 0;
+		Num t_end = l_max;
+		
+		for(size_t d = 0; d < dim; ++d) {
+			const Num dir = end[d] - start[d];
 			
-			if(data[i].first < std::min(result.lambda, l_max)) {
-				//pybind11::print("  Promising. Proceeding with child");
-				/*Num it_result = ray_trace(start, end, node.child(data[i].second), l_max);
-				//pybind11::print("  Child returned " + std::to_string(it_result));
-				result = std::min(result, it_result);*/
-				result << ray_trace(start, end, node.child(data[i].second), l_max);
-				//pybind11::print("  New threshold: " + std::to_string(result));
-			} else {
-				//pybind11::print("  Limit exceeded. Returning " + std::to_string(result));
-				//pybind11::print("  Limit exceeded. Trying anyway");
-				//Num it_result = ray_trace(start, end, node.child(data[i].second), l_max);
-				//pybind11::print("  Child returned " + std::to_string(it_result));
+			if(std::abs(dir) <= tol) {
+				if(start[d] < lo[d] || start[d] > hi[d])
+					return;
+				
 				continue;
 			}
+			
+			Num l1 = (lo[d] - start[d]) / dir;
+			Num l2 = (hi[d] - start[d]) / dir;
+			if(l1 > l2)
+				std::swap(l1, l2);
+			
+			t_begin = std::max(t_begin, l1);
+			t_end = std::min(t_end, l2);
+		}
+		
+		if(!(t_begin <= t_end))
+			return;
+		
+		// Amanatides-Woo walk: t_next holds the parameter of the next cell boundary along each axis
+		point_for<P> entry;
+		for(size_t d = 0; d < dim; ++d)
+			entry[d] = start[d] + t_begin * (end[d] - start[d]);
+		
+		MultiIndex cell = grid.index_for(entry);
+		
+		Num t_next[dim];
+		Num t_delta[dim];
+		int step[dim];
+		
+		for(size_t d = 0; d < dim; ++d) {
+			const Num dir = end[d] - start[d];
+			
+			if(std::abs(dir) <= tol) {
+				step[d] = 0;
+				t_next[d] = inf;
+				t_delta[d] = inf;
+				continue;
+			}
+			
+			const Num width = (hi[d] - lo[d]) / grid.size[d];
+			
+			step[d] = dir > 0 ? 1 : -1;
+			const Num boundary = lo[d] + (cell[d] + (dir > 0 ? 1 : 0)) * width;
+			
+			t_next[d] = (boundary - start[d]) / dir;
+			t_delta[d] = width / std::abs(dir);
+		}
+		
+		while(true) {
+			size_t axis = 0;
+			for(size_t d = 1; d < dim; ++d) {
+				if(t_next[d] < t_next[axis])
+					axis = d;
+			}
+			
+			const Num t_exit = t_next[axis];
+			
+			if(visit(cell, t_exit) || t_exit > t_end)
+				return;
+			
+			if(step[axis] > 0) {
+				if(++cell[axis] >= grid.size[axis])
+					return;
+			} else {
+				if(cell[axis] == 0)
+					return;
+				
+				--cell[axis];
+			}
+			
+			t_next[axis] += t_delta[axis];
 		}
 	}
-	
-	//pybind11::print("  All boxed processed. Returning " + std::to_string(result));
-	
-	return result;
 }
 
 template<typename G>
@@ -127,43 +327,121 @@ conditional_raytrace<G, G::tag == tags::grid> ray_trace(
 	const G& grid,
 	typename G::Point::numeric_type l_max
 ) {
-	using P = typename G::Point;
-	using Num = typename P::numeric_type;
-	using Tag = typename G::tag_type;
-	constexpr size_t dim = P::dimension;
-	
+	using Num = typename G::Point::numeric_type;
 	using MultiIndex = typename G::MultiIndex;
 	
-	MultiIndex i1 = grid.index_for(start);
-	MultiIndex i2 = grid.index_for(end);
+	RaytraceResult<Num> result;
+	internal::Mailbox mailbox;
 	
-	/*pybind11::print("P1: ");
-	for(size_t d = 0; d < dim; ++d)
-		pybind11::print("\t", start[d]);
-	pybind11::print("P2: ");
-	for(size_t d = 0; d < dim; ++d)
-		pybind11::print("\t", end[d]);
+	internal::walk_grid(start, end, grid, l_max, [&](const MultiIndex& cell, Num t_exit) {
+		for(size_t idx : grid.cell(cell)) {
+			if(mailbox.check(idx))
+				result << ray_trace(start, end, grid.mesh[idx], l_max);
+		}
+		
+		// Hits inside the current cell can not be beaten by any later cell
+		return result.lambda <= t_exit;
+	});
 	
-	pybind11::print("i1: ", i1);
-	pybind11::print("i2: ", i2);*/
+	return result;
+}
+
+template<typename W>
+conditional_raytrace<W, W::tag == tags::wide> ray_trace(
+	const point_for<typename W::Point>& start,
+	const point_for<typename W::Point>& end,
+	const W& wide,
+	typename W::Point::numeric_type l_max
+) {
+	using P = typename W::Point;
+	using Num = typename P::numeric_type;
+	constexpr size_t dim = P::dimension;
+	constexpr size_t width = W::lanes;
 	
-	const auto children = grid.query(i1, i2);
+	RaytraceResult<Num> result;
 	
-	//pybind11::print("Query hit", children.size(), " results");
+	if(wide.empty())
+		return result;
 	
-	//Num result = std::numeric_limits<Num>::infinity();
-	RaytraceResult<Num, Tag> result;
-	for(const auto child : children) {
-		auto bb = child.bounding_box();
+	// Directions within the tolerance of the box overload count as parallel. Replacing them by a tiny value
+	// keeps the slab test free of branches and NaNs while yielding the same result.
+	const Num tol = 5 * std::numeric_limits<Num>::epsilon();
+	Num inv_dir[dim];
+	for(size_t d = 0; d < dim; ++d) {
+		Num dir = end[d] - start[d];
+		
+		if(std::abs(dir) <= tol)
+			dir = std::copysign(std::numeric_limits<Num>::min(), dir);
 		
-		Num box_hit = ray_trace(start, end, child.bounding_box(), l_max).lambda;
-		//if(box_hit < std::numeric_limits<Num>::infinity())
-		//	pybind11::print("Box hit at ", box_hit);
+		inv_dir[d] = 1 / dir;
+	}
+	
+	using StackEntry = std::pair<uint32_t, Num>;
+	internal::TraversalStack<StackEntry, 64 * width> stack;
+	stack.push(StackEntry(0, 0));
+	
+	while(!stack.empty()) {
+		const StackEntry top = stack.pop();
 		
-		if(!(box_hit < result.lambda))
+		if(!(top.second < result.lambda && top.second <= l_max))
 			continue;
 		
-		result << ray_trace(start, end, child, l_max);
+		const auto& entry = wide.nodes[top.first];
+		
+		// Slab test against all lanes at once
+		Num t_low[width];
+		Num t_high[width];
+		
+		const Num limit = std::min(result.lambda, l_max);
+		for(size_t lane = 0; lane < width; ++lane) {
+			t_low[lane] = 0;
+			t_high[lane] = limit;
+		}
+		
+		for(size_t d = 0; d < dim; ++d) {
+			for(size_t lane = 0; lane < width; ++lane) {
+				const Num l1 = (entry.min[d][lane] - start[d]) * inv_dir[d];
+				const Num l2 = (entry.max[d][lane] - start[d]) * inv_dir[d];
+				
+				t_low[lane]  = std::max(t_low[lane],  std::min(l1, l2));
+				t_high[lane] = std::min(t_high[lane], std::max(l1, l2));
+			}
+		}
+		
+		// Order the hit lanes by distance
+		size_t order[width];
+		size_t n_hit = 0;
+		for(size_t lane = 0; lane < width; ++lane) {
+			if(!(t_low[lane] <= t_high[lane]))
+				continue;
+			
+			size_t pos = n_hit++;
+			for(; pos > 0 && t_low[order[pos - 1]] > t_low[lane]; --pos)
+				order[pos] = order[pos - 1];
+			
+			order[pos] = lane;
+		}
+		
+		// Intersect leaves front to back
+		for(size_t i = 0; i < n_hit; ++i) {
+			const size_t lane = order[i];
+			
+			if(entry.count[lane] == 0 || !(t_low[lane] < result.lambda))
+				continue;
+			
+			for(uint32_t j = 0; j < entry.count[lane]; ++j)
+				result << ray_trace(start, end, wide.mesh[entry.child[lane] + j], l_max);
+		}
+		
+		// Push inner children back to front, so that the closest one is processed next
+		for(size_t i = n_hit; i > 0; --i) {
+			const size_t lane = order[i - 1];
+			
+			if(entry.count[lane] != 0 || !(t_low[lane] < result.lambda))
+				continue;
+			
+			stack.push(StackEntry(entry.child[lane], t_low[lane]));
+		}
 	}
 	
 	return result;
@@ -178,7 +456,6 @@ conditional_raytrace<B, B::tag == tags::box> ray_trace(
 ) {
 	using PB = typename B::Point;
 	using Num = typename PB::numeric_type;
-	using Tag = typename B::tag_type;
 	constexpr size_t dim = PB::dimension;
 	
 	const PB p1 = box.min();
@@ -231,57 +508,89 @@ conditional_raytrace<B, B::tag == tags::box> ray_trace(
 	if(lower_bound > l_max)
 		return inf;
 	
-	return RaytraceResult<Num, Tag>(lower_bound);
+	return RaytraceResult<Num>(lower_bound);
 }
 
+namespace internal {
+	// Uses the cached intersection data of triangles that provide it
+	template<typename T>
+	auto triangle_data(const T& tri, int) -> decltype(tri.precomputed(), PrecomputedTriangle<typename T::Point>()) {
+		const auto* cached = tri.precomputed();
+		
+		if(cached != nullptr)
+			return *cached;
+		
+		return precompute_triangle(tri);
+	}
+	
+	template<typename T>
+	PrecomputedTriangle<typename T::Point> triangle_data(const T& tri, long) {
+		return precompute_triangle(tri);
+	}
+	
+	// Index of mesh triangles, free-standing triangles have none
+	template<typename T>
+	auto triangle_index(const T& tri, int) -> decltype((size_t) tri.index) {
+		return tri.index;
+	}
+	
+	template<typename T>
+	size_t triangle_index(const T&, long) {
+		return std::numeric_limits<size_t>::max();
+	}
+}
+
+// Moeller-Trumbore intersection of the segment start + l * (end - start) with the triangle
 template<typename T>
 conditional_raytrace<T, T::tag == tags::triangle && T::Point::dimension == 3> ray_trace(const point_for<typename T::Point>& start, const point_for<typename T::Point>& end, const T& tri, typename T::Point::numeric_type l_max) {
 	using P = typename T::Point;
 	using Num = typename P::numeric_type;
-	using Tag = typename T::tag_type;
-	using Mat = Eigen::Matrix<Num, 3, 3>;
-	using Vec = Eigen::Matrix<Num, 3, 1>;
-		
-	Mat m;
-	for(size_t i = 0; i < 3; ++i) {
-		m(i, 0) = end[i] - start[i];
-		m(i, 1) = tri.template get<1>()[i] - tri.template get<0>()[i];
-		m(i, 2) = tri.template get<2>()[i] - tri.template get<0>()[i];
-	}
 	
-	/*pybind11::print("INT matrix");
-	{
-		std::stringstream ss;
-		ss << m;
-		pybind11::print(ss.str());
-	}*/
+	const PrecomputedTriangle<P> data = internal::triangle_data(tri, 0);
+	const auto& e1 = data.edge1;
+	const auto& e2 = data.edge2;
 	
-	Vec v;
-	for(size_t i = 0; i < 3; ++i) {
-		v(i, 0) = start[i] - tri.template get<0>()[i];
-	}
+	const Num d[3] = {end[0] - start[0], end[1] - start[1], end[2] - start[2]};
 	
-	/*pybind11::print("INT vec");
-	{
-		std::stringstream ss;
-		ss << v;
-		pybind11::print(ss.str());
-	}*/
+	// p = d x e2
+	const Num p[3] = {
+		d[1] * e2[2] - d[2] * e2[1],
+		d[2] * e2[0] - d[0] * e2[2],
+		d[0] * e2[1] - d[1] * e2[0]
+	};
 	
-	Vec vi = m.partialPivLu().solve(v);
+	const Num det = e1[0] * p[0] + e1[1] * p[1] + e1[2] * p[2];
 	
-	const Num l = -vi(0, 0);
-	const Num inf = std::numeric_limits<Num>::infinity();
+	// Segment parallel to the triangle plane
+	if(det == 0)
+		return RaytraceResult<Num>();
+	
+	const Num inv_det = 1 / det;
+	
+	const Num s[3] = {start[0] - data.origin[0], start[1] - data.origin[1], start[2] - data.origin[2]};
+	
+	const Num u = (s[0] * p[0] + s[1] * p[1] + s[2] * p[2]) * inv_det;
+	if(u < 0 || u > 1)
+		return RaytraceResult<Num>();
+	
+	// q = s x e1
+	const Num q[3] = {
+		s[1] * e1[2] - s[2] * e1[1],
+		s[2] * e1[0] - s[0] * e1[2],
+		s[0] * e1[1] - s[1] * e1[0]
+	};
+	
+	const Num v = (d[0] * q[0] + d[1] * q[1] + d[2] * q[2]) * inv_det;
+	if(v < 0 || u + v > 1)
+		return RaytraceResult<Num>();
+	
+	const Num l = (e2[0] * q[0] + e2[1] * q[1] + e2[2] * q[2]) * inv_det;
 	
 	// Check if we didn't hit the triangle plane
 	if(l > l_max || l < 0)
-		return RaytraceResult<Num, Tag>();
+		return RaytraceResult<Num>();
 	
-	// Check if we missed the triangle
-	if(vi(1, 0) < 0 || vi(2, 0) < 0 || vi(1, 0) + vi(2, 0) > 1)
-		return RaytraceResult<Num, Tag>();
-	
-	return RaytraceResult<Num, Tag>(l, tri.tags());
+	return RaytraceResult<Num>(l, internal::triangle_index(tri, 0));
 }
 
 template<typename T>
@@ -290,43 +599,312 @@ conditional_raytrace<T, T::tag == tags::triangle && T::Point::dimension != 3> ra
 }
 
 
-/*template<typename T>
-typename std::enable_if_t<
-	T::tag == tags::triangle && T::Point::dimension == 2,
-	typename T::Point::numeric_type
-> ray_trace(const typename T::Point& start, const typename T::Point& end, const T& tri, typename T::Point::numeric_type l_max) {
-	using P = typename T::Point;
-	using Num = typename P::numeric_type;
+/** Returns whether the segment hits any triangle before l_max. Traversal stops at the first hit found,
+ *  so neither the order of the children nor the distance of the hit is tracked. */
+template<typename N>
+std::enable_if_t<N::tag == tags::node, bool> occluded(
+	const point_for<typename N::Point>& start,
+	const point_for<typename N::Point>& end,
+	const N& node,
+	typename N::Point::numeric_type l_max
+) {
+	internal::TraversalStack<N, 256> stack;
+	stack.push(node);
+	
+	while(!stack.empty()) {
+		const N current = stack.pop();
+		
+		for(size_t i = 0; i < current.n_data(); ++i) {
+			if(ray_trace(start, end, current.data(i), l_max).hit())
+				return true;
+		}
+		
+		for(size_t i = 0; i < current.n_children(); ++i) {
+			const N child = current.child(i);
+			
+			if(ray_trace(start, end, child.bounding_box(), l_max).hit())
+				stack.push(child);
+		}
+	}
+	
+	return false;
+}
+
+template<typename G>
+std::enable_if_t<G::tag == tags::grid, bool> occluded(
+	const point_for<typename G::Point>& start,
+	const point_for<typename G::Point>& end,
+	const G& grid,
+	typename G::Point::numeric_type l_max
+) {
+	using Num = typename G::Point::numeric_type;
+	using MultiIndex = typename G::MultiIndex;
+	
+	bool result = false;
+	internal::Mailbox mailbox;
+	
+	internal::walk_grid(start, end, grid, l_max, [&](const MultiIndex& cell, Num) {
+		for(size_t idx : grid.cell(cell)) {
+			if(mailbox.check(idx) && ray_trace(start, end, grid.mesh[idx], l_max).hit()) {
+				result = true;
+				break;
+			}
+		}
+		
+		return result;
+	});
+	
+	return result;
+}
+
+namespace internal {
+	// Sorts the hits appended since begin by distance and drops repeated triangles
+	template<typename Num>
+	void sort_hits(std::vector<RaytraceResult<Num>>& hits, size_t begin) {
+		using R = RaytraceResult<Num>;
+		
+		std::sort(hits.begin() + begin, hits.end(), [](const R& r1, const R& r2) {
+			return r1.lambda < r2.lambda || (r1.lambda == r2.lambda && r1.index < r2.index);
+		});
+		
+		auto new_end = std::unique(hits.begin() + begin, hits.end(), [](const R& r1, const R& r2) {
+			return r1.index == r2.index;
+		});
+		hits.erase(new_end, hits.end());
+	}
+}
+
+/** Appends all triangles hit by the segment up to l_max to hits, sorted by lambda. */
+template<typename N>
+std::enable_if_t<N::tag == tags::node> ray_trace_all(
+	const point_for<typename N::Point>& start,
+	const point_for<typename N::Point>& end,
+	const N& node,
+	typename N::Point::numeric_type l_max,
+	std::vector<raytrace_result_for<N>>& hits
+) {
+	const size_t begin = hits.size();
+	
+	internal::TraversalStack<N, 256> stack;
+	stack.push(node);
+	
+	while(!stack.empty()) {
+		const N current = stack.pop();
+		
+		for(size_t i = 0; i < current.n_data(); ++i) {
+			const auto hit = ray_trace(start, end, current.data(i), l_max);
+			
+			if(hit.hit())
+				hits.push_back(hit);
+		}
+		
+		for(size_t i = 0; i < current.n_children(); ++i) {
+			const N child = current.child(i);
+			
+			if(ray_trace(start, end, child.bounding_box(), l_max).hit())
+				stack.push(child);
+		}
+	}
 	
-	using PMat = Eigen::Matrix<Num, 4, 2>;
-	PMat m;
-	
-	m(0, 0) = end[0] - start[0];
-	m(0, 1) = end[1] - start[1];
-	m(1, 0) = tri.get<1>[1] - tri.get<0>[1];
-	m(1, 1) = tri.get<0>[0] - tri.get<1>[0];
-	m(2, 0) = tri.get<2>[1] - tri.get<0>[1];
-	m(2, 1) = tri.get<0>[0] - tri.get<2>[0];
-	m(3, 0) = tri.get<2>[1] - tri.get<1>[1];
-	m(3, 1) = tri.get<1>[0] - tri.get<2>[0];
-	
-	Eigen::Matrix<Num, 2, 2> eline;
-	eline(0, 0) = start[0];
-	eline(1, 0) = start[1];
-	eline(0, 1) = end[0];
-	eline(1, 1) = end[1];
-	
-	Eigen::Matrix<Num, 2, 3> etri;
-	eline(0, 0) = tri.get<0>[0];
-	eline(1, 0) = tri.get<0>[1];
-	eline(0, 1) = tri.get<1>[0];
-	eline(1, 1) = tri.get<1>[1];
-	eline(0, 2) = tri.get<2>[0];
-	eline(1, 2) = tri.get<2>[1];
-	
-	auto p_line = m * eline;
-	auto p_tri  = m * etri;
-	
-	if((p_line.rowwise().maxCoeff() > p_tri.rowwise().minCoeff() && p
-}*/
+	internal::sort_hits(hits, begin);
+}
+
+template<typename G>
+std::enable_if_t<G::tag == tags::grid> ray_trace_all(
+	const point_for<typename G::Point>& start,
+	const point_for<typename G::Point>& end,
+	const G& grid,
+	typename G::Point::numeric_type l_max,
+	std::vector<raytrace_result_for<G>>& hits
+) {
+	using Num = typename G::Point::numeric_type;
+	using MultiIndex = typename G::MultiIndex;
+	
+	const size_t begin = hits.size();
+	internal::Mailbox mailbox;
+	
+	// Triangles spanning several cells can slip past the mailbox. These duplicates are removed after sorting.
+	internal::walk_grid(start, end, grid, l_max, [&](const MultiIndex& cell, Num) {
+		for(size_t idx : grid.cell(cell)) {
+			if(!mailbox.check(idx))
+				continue;
+			
+			const auto hit = ray_trace(start, end, grid.mesh[idx], l_max);
+			
+			if(hit.hit())
+				hits.push_back(hit);
+		}
+		
+		return false;
+	});
+	
+	internal::sort_hits(hits, begin);
+}
+
+namespace internal {
+	// Side from which the segment crosses the triangle: +1 when leaving through the front face (the side the
+	// normal (p1 - p0) x (p2 - p0) points to), -1 when entering through it and 0 for misses. Crossings too
+	// close to an edge or vertex can not be assigned reliably and set ambiguous.
+	template<typename T>
+	int crossing_sign(const point_for<typename T::Point>& start, const point_for<typename T::Point>& end, const T& tri, bool& ambiguous) {
+		using Num = typename T::Point::numeric_type;
+		
+		const PrecomputedTriangle<typename T::Point> data = triangle_data(tri, 0);
+		const auto& e1 = data.edge1;
+		const auto& e2 = data.edge2;
+		
+		const Num d[3] = {end[0] - start[0], end[1] - start[1], end[2] - start[2]};
+		const Num p[3] = {
+			d[1] * e2[2] - d[2] * e2[1],
+			d[2] * e2[0] - d[0] * e2[2],
+			d[0] * e2[1] - d[1] * e2[0]
+		};
+		
+		const Num det = e1[0] * p[0] + e1[1] * p[1] + e1[2] * p[2];
+		
+		// Segments running along the triangle plane cross the mesh through a neighbouring triangle
+		if(det == 0)
+			return 0;
+		
+		const Num inv_det = 1 / det;
+		const Num s[3] = {start[0] - data.origin[0], start[1] - data.origin[1], start[2] - data.origin[2]};
+		const Num q[3] = {
+			s[1] * e1[2] - s[2] * e1[1],
+			s[2] * e1[0] - s[0] * e1[2],
+			s[0] * e1[1] - s[1] * e1[0]
+		};
+		
+		const Num u = (s[0] * p[0] + s[1] * p[1] + s[2] * p[2]) * inv_det;
+		const Num v = (d[0] * q[0] + d[1] * q[1] + d[2] * q[2]) * inv_det;
+		const Num l = (e2[0] * q[0] + e2[1] * q[1] + e2[2] * q[2]) * inv_det;
+		
+		if(l < 0 || l > 1)
+			return 0;
+		
+		const Num tol = 1024 * std::numeric_limits<Num>::epsilon();
+		const Num w = 1 - u - v;
+		
+		if(u < -tol || v < -tol || w < -tol)
+			return 0;
+		
+		if(u <= tol || v <= tol || w <= tol) {
+			ambiguous = true;
+			return 0;
+		}
+		
+		return det < 0 ? 1 : -1;
+	}
+	
+	// Sums the crossing signs of all triangles below node along the segment. Stops early once a crossing
+	// turns out to be ambiguous.
+	template<typename N>
+	void count_crossings(
+		const point_for<typename N::Point>& start,
+		const point_for<typename N::Point>& end,
+		const N& node,
+		int& winding, size_t& crossings, bool& ambiguous
+	) {
+		TraversalStack<N, 256> stack;
+		stack.push(node);
+		
+		while(!stack.empty() && !ambiguous) {
+			const N current = stack.pop();
+			
+			for(size_t i = 0; i < current.n_data() && !ambiguous; ++i) {
+				const int sign = crossing_sign(start, end, current.data(i), ambiguous);
+				
+				winding += sign;
+				crossings += sign != 0;
+			}
+			
+			for(size_t i = 0; i < current.n_children(); ++i) {
+				const N child = current.child(i);
+				
+				if(ray_trace(start, end, child.bounding_box(), 1).hit())
+					stack.push(child);
+			}
+		}
+	}
+	
+	// Casts a ray from p out of the bounding box of node. Directions are tried in turn until one avoids all
+	// edges and vertices of the mesh. If every direction is ambiguous, p lies on an edge or vertex (up to
+	// rounding), which is reported as outside: winding and crossings are 0.
+	template<typename N>
+	void cast_inside_ray(const point_for<typename N::Point>& p, const N& node, int& winding, size_t& crossings) {
+		using P = point_for<typename N::Point>;
+		using Num = typename P::numeric_type;
+		
+		static const Num directions[][3] = {
+			{ 0.2361,  0.6180,  0.7498},
+			{-0.7071,  0.1234,  0.6963},
+			{ 0.5117, -0.8031,  0.3051},
+			{-0.3333, -0.4472, -0.8302},
+			{ 0.9129,  0.2887, -0.2887},
+			{-0.1471,  0.9535, -0.2632},
+			{ 0.6325, -0.1925, -0.7503},
+			{-0.8660, -0.4330,  0.2500}
+		};
+		
+		winding = 0;
+		crossings = 0;
+		
+		const auto bb = node.bounding_box();
+		
+		Num length = 0;
+		for(size_t d = 0; d < 3; ++d) {
+			if(!(p[d] >= bb.min()[d] && p[d] <= bb.max()[d]))
+				return;
+			
+			const Num extent = bb.max()[d] - bb.min()[d];
+			length += extent * extent;
+		}
+		
+		// Longer than the box diagonal, so the segment always ends outside
+		length = 2 * std::sqrt(length) + 1;
+		
+		for(const auto& dir : directions) {
+			P end;
+			for(size_t d = 0; d < 3; ++d)
+				end[d] = p[d] + length * dir[d];
+			
+			bool ambiguous = false;
+			winding = 0;
+			crossings = 0;
+			
+			count_crossings(p, end, node, winding, crossings, ambiguous);
+			
+			if(!ambiguous)
+				return;
+		}
+		
+		// The counts of the last direction are incomplete
+		winding = 0;
+		crossings = 0;
+	}
+}
+
+/** Winding number of a closed mesh around p. Counts the signed crossings of a ray leaving the mesh, where
+ *  triangles whose normal (p1 - p0) x (p2 - p0) points away from p count +1. For outward oriented
+ *  meshes the result is 1 inside and 0 outside. Points on an edge or vertex of the mesh give 0. */
+template<typename N>
+std::enable_if_t<N::tag == tags::node && N::Point::dimension == 3, int> winding_number(const point_for<typename N::Point>& p, const N& node) {
+	int winding;
+	size_t crossings;
+	internal::cast_inside_ray(p, node, winding, crossings);
+	
+	return winding;
+}
+
+/** Whether p lies inside the closed mesh below node. Uses the parity of the number of crossings along a ray,
+ *  which does not depend on the orientation of the triangles. Points on an edge or vertex of the mesh count as
+ *  outside, points on a face may be reported either way. */
+template<typename N>
+std::enable_if_t<N::tag == tags::node && N::Point::dimension == 3, bool> contains(const point_for<typename N::Point>& p, const N& node) {
+	int winding;
+	size_t crossings;
+	internal::cast_inside_ray(p, node, winding, crossings);
+	
+	return crossings % 2 == 1;
+}
+
 }
\ No newline at end of file
@@ -0,0 +1,287 @@
+#pragma once
+
+#include <cmath>
+#include <memory>
+#include <stdexcept>
+#include <vector>
+
+#include <tinygeo/point.h>
+#include <tinygeo/box.h>
+#include <tinygeo/pack.h>
+#include <tinygeo/raytrace.h>
+
+namespace tinygeo {
+
+/** Rigid transformation x -> rotation * x + translation. The rotation must be orthonormal. */
+template<typename Num>
+struct RigidTransform {
+	using P = Point<3, Num>;
+	
+	Num rotation[3][3];
+	Num translation[3];
+	
+	static RigidTransform identity() {
+		RigidTransform result;
+		
+		for(size_t i = 0; i < 3; ++i) {
+			for(size_t j = 0; j < 3; ++j)
+				result.rotation[i][j] = i == j ? 1 : 0;
+			
+			result.translation[i] = 0;
+		}
+		
+		return result;
+	}
+	
+	P apply(const P& p) const {
+		P result;
+		
+		for(size_t i = 0; i < 3; ++i)
+			result[i] = rotation[i][0] * p[0] + rotation[i][1] * p[1] + rotation[i][2] * p[2] + translation[i];
+		
+		return result;
+	}
+	
+	P apply_inverse(const P& p) const {
+		const Num d[3] = {p[0] - translation[0], p[1] - translation[1], p[2] - translation[2]};
+		
+		P result;
+		for(size_t i = 0; i < 3; ++i)
+			result[i] = rotation[0][i] * d[0] + rotation[1][i] * d[1] + rotation[2][i] * d[2];
+		
+		return result;
+	}
+	
+	// Bounding box of the transformed box (Arvo)
+	Box<P> apply(const Box<P>& box) const {
+		if(is_empty(box))
+			return box;
+		
+		P min;
+		P max;
+		
+		for(size_t i = 0; i < 3; ++i) {
+			min[i] = max[i] = translation[i];
+			
+			for(size_t j = 0; j < 3; ++j) {
+				const Num a = rotation[i][j] * box.min()[j];
+				const Num b = rotation[i][j] * box.max()[j];
+				
+				min[i] += std::min(a, b);
+				max[i] += std::max(a, b);
+			}
+		}
+		
+		return Box<P>(min, max);
+	}
+	
+	// Throws if the rotation is not orthonormal within the given tolerance
+	void check(Num tol = 1e-6) const {
+		for(size_t i = 0; i < 3; ++i) {
+			for(size_t j = 0; j < 3; ++j) {
+				Num dot = 0;
+				for(size_t k = 0; k < 3; ++k)
+					dot += rotation[k][i] * rotation[k][j];
+				
+				if(std::abs(dot - (i == j ? 1 : 0)) > tol)
+					throw std::invalid_argument("Rotation matrix of rigid transform is not orthonormal");
+			}
+		}
+	}
+};
+
+/** Type-erased geometry that can be placed into a Scene. Segments are given in the local coordinates of
+ *  the object. */
+template<typename Num>
+struct SceneObject {
+	using P = Point<3, Num>;
+	
+	virtual Box<P> bounding_box() = 0;
+	virtual RaytraceResult<Num> ray_trace(const P& start, const P& end, Num l_max) = 0;
+	
+	virtual ~SceneObject() {}
+};
+
+/** Scene object tracing through the tree of an indexed mesh. The mesh is referenced, not copied, and must
+ *  outlive the object. */
+template<typename Mesh, typename Num = double>
+struct MeshObject : public SceneObject<Num> {
+	using P = Point<3, Num>;
+	using MeshPoint = point_for<typename Mesh::Point>;
+	using MeshNum = typename MeshPoint::numeric_type;
+	
+	static_assert(Mesh::Point::dimension == 3, "Scenes only hold 3D meshes");
+	
+	Mesh& mesh;
+	
+	MeshObject(Mesh& mesh) : mesh(mesh) {}
+	
+	Box<P> bounding_box() override {
+		const auto bb = mesh.root().bounding_box();
+		return Box<P>(P(bb.min()), P(bb.max()));
+	}
+	
+	RaytraceResult<Num> ray_trace(const P& start, const P& end, Num l_max) override {
+		const auto hit = tinygeo::ray_trace(MeshPoint(start), MeshPoint(end), mesh.root(), (MeshNum) l_max);
+		
+		if(!hit.hit())
+			return RaytraceResult<Num>();
+		
+		return RaytraceResult<Num>(hit.lambda, hit.index);
+	}
+};
+
+/** Closest hit in a scene. index refers to the triangle within the mesh of the hit instance. */
+template<typename Num>
+struct SceneHit : public RaytraceResult<Num> {
+	size_t instance = RaytraceResult<Num>::no_hit;
+	
+	SceneHit() = default;
+	SceneHit(const RaytraceResult<Num>& hit, size_t instance) : RaytraceResult<Num>(hit), instance(instance) {}
+};
+
+/** A collection of objects placed with rigid transforms under a top-level tree. The same object can be
+ *  added any number of times. Its geometry is shared between the instances, segments are transformed into
+ *  the local coordinates of each instance instead. Since the transforms are affine, the segment parameter
+ *  lambda is the same in both frames. */
+template<typename Num>
+struct Scene {
+	using P = Point<3, Num>;
+	using Transform = RigidTransform<Num>;
+	
+	struct Instance {
+		std::shared_ptr<SceneObject<Num>> object;
+		Transform transform;
+		
+		// Bounding box in scene coordinates
+		Box<P> box;
+	};
+	
+	std::vector<Instance> instances;
+	
+	/** Adds an instance and returns its id. Call build() before tracing. */
+	size_t add(std::shared_ptr<SceneObject<Num>> object, const Transform& transform = Transform::identity()) {
+		transform.check();
+		
+		Instance instance;
+		instance.object = std::move(object);
+		instance.transform = transform;
+		instance.box = transform.apply(instance.object -> bounding_box());
+		
+		instances.push_back(std::move(instance));
+		built = false;
+		
+		return instances.size() - 1;
+	}
+	
+	bool needs_build() const { return !built; }
+	
+	/** Builds the top-level tree over the instance boxes. The object boxes are re-read, so this also needs
+	 *  to be called after an object was repacked or refit. */
+	void build(size_t size = 4) {
+		std::vector<Item> items;
+		items.reserve(instances.size());
+		
+		for(size_t i = 0; i < instances.size(); ++i) {
+			Instance& instance = instances[i];
+			instance.box = instance.transform.apply(instance.object -> bounding_box());
+			
+			items.push_back(Item{i, instance.box});
+		}
+		
+		if(items.empty()) {
+			tree.data.clear();
+			tree.children.clear();
+			tree.box = Box<P>::empty();
+		} else {
+			tree = pack(items.begin(), items.end(), size);
+		}
+		
+		built = true;
+	}
+	
+	SceneHit<Num> ray_trace(const P& start, const P& end, Num l_max) const {
+		if(!built)
+			throw std::logic_error("Scene was modified, call build() before tracing");
+		
+		using PairType = std::pair<Num, size_t>;
+		
+		// Children are sorted by distance in a local buffer. Nodes with more children are visited unsorted.
+		constexpr size_t max_sorted = 64;
+		
+		struct StackEntry {
+			Num distance;
+			const PackNode<Item>* node;
+		};
+		
+		SceneHit<Num> result;
+		
+		if(tree.data.empty() && tree.children.empty())
+			return result;
+		
+		internal::TraversalStack<StackEntry, 64> stack;
+		stack.push(StackEntry{0, &tree});
+		
+		while(!stack.empty()) {
+			const StackEntry entry = stack.pop();
+			
+			if(!(entry.distance < std::min(result.lambda, l_max)))
+				continue;
+			
+			const PackNode<Item>& node = *entry.node;
+			
+			// Trace the instances in their local coordinates
+			for(const Item& item : node.data) {
+				// Hits behind the closest one so far can not improve the result
+				const Num limit = std::min(result.lambda, l_max);
+				
+				if(!(tinygeo::ray_trace(start, end, item.box, limit).lambda < result.lambda))
+					continue;
+				
+				const Instance& instance = instances[item.instance];
+				const auto hit = instance.object -> ray_trace(instance.transform.apply_inverse(start), instance.transform.apply_inverse(end), limit);
+				
+				if(hit.lambda < result.lambda)
+					result = SceneHit<Num>(hit, item.instance);
+			}
+			
+			const size_t n_children = node.children.size();
+			PairType hits[max_sorted];
+			size_t n_hits = 0;
+			
+			for(size_t i = 0; i < n_children; ++i) {
+				const Num distance = tinygeo::ray_trace(start, end, node.children[i].box, l_max).lambda;
+				
+				if(!(distance < std::min(result.lambda, l_max)))
+					continue;
+				
+				if(n_children <= max_sorted)
+					hits[n_hits++] = PairType(distance, i);
+				else
+					stack.push(StackEntry{distance, &node.children[i]});
+			}
+			
+			// Push the farthest child first, so that the closest one is processed next
+			internal::sort_descending(hits, n_hits);
+			for(size_t i = 0; i < n_hits; ++i)
+				stack.push(StackEntry{hits[i].first, &node.children[hits[i].second]});
+		}
+		
+		return result;
+	}
+
+private:
+	struct Item {
+		using Point = P;
+		
+		size_t instance;
+		Box<P> box;
+		
+		const Box<P>& bounding_box() const { return box; }
+	};
+	
+	PackNode<Item> tree;
+	bool built = true;
+};
+
+}
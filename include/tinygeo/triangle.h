@@ -18,6 +18,34 @@ static Box<point_for<typename T::Point>> triangle_bounding_box(const T& tri) {
 	);
 }
 
+/** Per-triangle data of the ray intersection kernel: The first vertex and the two edges leaving it */
+template<typename P>
+struct PrecomputedTriangle {
+	using Point = point_for<P>;
+	
+	Point origin;
+	Point edge1;
+	Point edge2;
+};
+
+template<typename T>
+PrecomputedTriangle<typename T::Point> precompute_triangle(const T& tri) {
+	using P = point_for<typename T::Point>;
+	
+	const P p0 = tri.template get<0>();
+	const P p1 = tri.template get<1>();
+	const P p2 = tri.template get<2>();
+	
+	PrecomputedTriangle<typename T::Point> result;
+	result.origin = p0;
+	for(size_t i = 0; i < P::dimension; ++i) {
+		result.edge1[i] = p1[i] - p0[i];
+		result.edge2[i] = p2[i] - p0[i];
+	}
+	
+	return result;
+}
+
 template<typename P>
 struct Triangle {
 	using Point = point_for<P>;
@@ -4,18 +4,12 @@
 
 #include <tinygeo/buffer.h>
 #include <tinygeo/raytrace.h>
+#include <tinygeo/distance.h>
+#include <tinygeo/query.h>
+#include <tinygeo/scene.h>
+#include <tinygeo/morton.h>
 #include <tinygeo/capnp.h>
-
-// POSIX-style file-handling
-#if _WIN32
-#include <kj/miniposix.h>
-#else
-#include <sys/types.h>
-#include <sys/stat.h>
-#include <fcntl.h>
-#endif
-
-#include <capnp/serialize.h>
+#include <tinygeo/parallel.h>
 
 namespace py = pybind11;
 namespace tr = tinygeo;
@@ -34,17 +28,35 @@ struct PyArrayBuffer {
 	
 	size_t shape(size_t i) const { return data.shape(i); }
 	
+	// Used to copy the buffer in bulk when saving
+	const Num* contiguous_data() const { return (data.flags() & py::array::c_style) ? data.data() : nullptr; }
+	
 	PyArrayBuffer(const py::array_t<Num>& data) : data(data) {}
 	PyArrayBuffer(const size_t m, const size_t n) : data({m, n}) {}
 };
 
+// Wraps a mesh for use in a Scene. The mesh is referenced, so the scene needs to keep it alive.
+template<typename Mesh>
+std::enable_if_t<Mesh::Point::dimension == 3, std::shared_ptr<tr::SceneObject<double>>> make_scene_object(Mesh& mesh) {
+	return std::make_shared<tr::MeshObject<Mesh>>(mesh);
+}
+
+template<typename Mesh>
+std::enable_if_t<Mesh::Point::dimension != 3, std::shared_ptr<tr::SceneObject<double>>> make_scene_object(Mesh& mesh) {
+	throw std::invalid_argument("Only 3D meshes can be added to a scene");
+}
+
 struct PyArrayTriangleMeshBase {
 	virtual py::array& get_data() = 0;
 	virtual py::array& get_idx()  = 0;
 	virtual py::array& get_tags() = 0;
 	virtual size_t get_dim() = 0;
-	virtual void py_pack(size_t size) = 0;
-	virtual void save(const std::string& fname) = 0;
+	virtual void py_pack(size_t size, tr::PackStrategy strategy) = 0;
+	virtual void py_refit() = 0;
+	virtual double py_sah_cost() = 0;
+	virtual void py_build_wide(size_t width) = 0;
+	virtual std::shared_ptr<tr::SceneObject<double>> scene_object() = 0;
+	virtual void save(const std::string& fname, bool packed, tr::VertexEncoding vertices) = 0;
 	
 	virtual std::vector<size_t> get_grid_size() = 0;
 	virtual void set_grid_size(const std::vector<size_t>&) = 0;
@@ -55,9 +67,9 @@ struct PyArrayTriangleMeshBase {
 template<size_t dim, typename Num, typename Idx, typename Tag>
 struct PyArrayTriangleMesh :
 	public PyArrayTriangleMeshBase,
-	public tr::IndexedTriangleMesh<dim, PyArrayBuffer<Num>, PyArrayBuffer<Idx>, PyArrayBuffer<Tag>, tr::SimpleNodeData<tr::Point<dim, Num>>, tr::SimpleGridData>
+	public tr::IndexedTriangleMesh<dim, PyArrayBuffer<Num>, PyArrayBuffer<Idx>, PyArrayBuffer<Tag>, tr::FlatNodeData<tr::Point<dim, Num>>, tr::CSRGridData>
 {
-	using MeshType = tr::IndexedTriangleMesh<dim, PyArrayBuffer<Num>, PyArrayBuffer<Idx>, PyArrayBuffer<Tag>, tr::SimpleNodeData<tr::Point<dim, Num>>, tr::SimpleGridData>;
+	using MeshType = tr::IndexedTriangleMesh<dim, PyArrayBuffer<Num>, PyArrayBuffer<Idx>, PyArrayBuffer<Tag>, tr::FlatNodeData<tr::Point<dim, Num>>, tr::CSRGridData>;
 	
 	using typename MeshType::Point;
 	using typename MeshType::Accessor;
@@ -65,7 +77,7 @@ struct PyArrayTriangleMesh :
 	using InlinePoint = tr::point_for<Point>;
 	
 	PyArrayTriangleMesh(const py::array_t<Num>& data, const py::array_t<Idx>& indices, const py::array_t<Tag>& tags) :
-		MeshType(PyArrayBuffer<Num>(data), PyArrayBuffer<Idx>(indices), PyArrayBuffer<Tag>(tags), tr::SimpleNodeData<InlinePoint>(), tr::SimpleGridData())
+		MeshType(PyArrayBuffer<Num>(data), PyArrayBuffer<Idx>(indices), PyArrayBuffer<Tag>(tags), tr::FlatNodeData<InlinePoint>(), tr::CSRGridData())
 	{
 		// Create a single R-Tree node with no children, holding all triangles
 		this -> root_data.set_start(0);
@@ -80,7 +92,7 @@ struct PyArrayTriangleMesh :
 			bb = tr::combine_boxes(bb, it->bounding_box());
 		}
 		
-		this -> root_data.bounding_box() = bb; // bounding_box returns a reference for SimpleNodeData
+		this -> root_data.bounding_box() = bb; // bounding_box returns a reference for FlatNodeData
 	}
 	
 	py::array& get_data() override { return this->point_buffer.data; }
@@ -88,7 +100,11 @@ struct PyArrayTriangleMesh :
 	py::array& get_tags() override { return this->tag_buffer.data; }
 	
 	size_t get_dim() override { return dim; }
-	void py_pack(size_t size) override { this -> pack(size); }
+	void py_pack(size_t size, tr::PackStrategy strategy) override { this -> pack(size, strategy); }
+	void py_refit() override { this -> refit(); }
+	double py_sah_cost() override { return this -> sah_cost(); }
+	void py_build_wide(size_t width) override { this -> build_wide(width); }
+	std::shared_ptr<tr::SceneObject<double>> scene_object() override { return make_scene_object(*this); }
 	
 	std::vector<size_t> get_grid_size() override {
 		return std::vector<size_t>(this -> grid.size.begin(), this -> grid.size.end());
@@ -103,27 +119,12 @@ struct PyArrayTriangleMesh :
 			this -> grid.size[d] = new_size[d];
 	}
 	
-	//TODO: Move this into a templated method
-	void save(const std::string& fname) override {
-		// Build the serial representation
-		capnp::MallocMessageBuilder builder;
-		
-		auto root = builder.initRoot<tr::capnp::GeoFile>();
-		tr::capnp::save_mesh(*this, root);
-		
-		// Write it out
-		
-		#if _WIN32 && !__MINGW32__
-		// Thanks Microsoft for inventing your "own" API -.-
-		const int fd = _open(fname.c_str(), _O_CREAT | _O_TRUNC |_O_BINARY | _O_RDWR, _S_IWRITE);
-		#else
-		const int fd = open(fname.c_str(), O_CREAT | O_TRUNC | O_RDWR, S_IRUSR | S_IWUSR | S_IRGRP);
-		#endif
+	void save(const std::string& fname, bool packed, tr::VertexEncoding vertices) override {
+		tr::SaveOptions options;
+		options.packed = packed;
+		options.vertices = vertices;
 		
-		capnp::writeMessageToFd(fd, builder);
-		
-		// Provided on Win32 by kj/miniposix.h
-		close(fd);
+		tr::capnp::save_file(*this, fname, options);
 	}
 };
 
@@ -192,6 +193,167 @@ auto register_point(std::string name, M& m) {
 	;
 }
 
+// Hit record with resolved tags, as returned by the ray_cast_detail methods
+template<typename Num, typename Tag>
+struct PyRaycastResult {
+	Num lambda;
+	std::int64_t index;
+	std::vector<Tag> tags;
+};
+
+template<typename Mesh, typename Num>
+PyRaycastResult<Num, typename Mesh::Accessor::tag_type> resolve_hit(Mesh& m, const tr::RaytraceResult<Num>& hit) {
+	PyRaycastResult<Num, typename Mesh::Accessor::tag_type> result;
+	result.lambda = hit.lambda;
+	result.index = -1;
+	
+	if(hit.index != tr::RaytraceResult<Num>::no_hit) {
+		result.index = hit.index;
+		result.tags = m.tags(hit.index);
+	}
+	
+	return result;
+}
+
+template<typename Num>
+std::int64_t resolve_index(const tr::RaytraceResult<Num>& hit) {
+	return hit.index == tr::RaytraceResult<Num>::no_hit ? -1 : (std::int64_t) hit.index;
+}
+
+// Traces through whichever wide tree was built
+template<typename Mesh, typename Num = typename Mesh::Point::numeric_type, typename P = tr::point_for<typename Mesh::Node::Point>>
+auto trace_wide(Mesh& m, const P& p1, const P& p2, Num l_max) {
+	if(!m.wide8.empty())
+		return tr::ray_trace(p1, p2, m.wide8, l_max);
+	if(!m.wide4.empty())
+		return tr::ray_trace(p1, p2, m.wide4, l_max);
+	
+	throw std::logic_error("No wide tree available. Call build_wide() first");
+}
+
+template<typename Num>
+using PointArray = py::array_t<Num, py::array::c_style | py::array::forcecast>;
+
+template<typename Num>
+void check_points(const PointArray<Num>& points, const std::string& name) {
+	if(points.ndim() == 0 || points.shape(points.ndim() - 1) != 3)
+		throw std::invalid_argument(name + " must have shape [..., 3]");
+}
+
+// Collects all hits of a batch of segments. Returns (offsets, lambda, index) where the hits of ray i are
+// stored in lambda[offsets[i]:offsets[i+1]] and index[offsets[i]:offsets[i+1]], sorted by lambda.
+template<typename P, typename Num, typename F>
+py::tuple trace_all(PointArray<Num> p1, PointArray<Num> p2, Num l_max, F&& f) {
+	check_points(p1, "Start points");
+	
+	if(p1.ndim() != p2.ndim() || !std::equal(p1.shape(), p1.shape() + p1.ndim(), p2.shape()))
+		throw std::invalid_argument("Start and end points must have the same shape");
+	
+	const size_t n_rays = p1.size() / 3;
+	const P* starts = reinterpret_cast<const P*>(p1.data());
+	const P* ends   = reinterpret_cast<const P*>(p2.data());
+	
+	std::vector<tr::RaytraceResult<Num>> hits;
+	py::array_t<std::int64_t> offsets(n_rays + 1);
+	std::int64_t* offset_data = offsets.mutable_data();
+	
+	offset_data[0] = 0;
+	for(size_t i = 0; i < n_rays; ++i) {
+		f(starts[i], ends[i], l_max, hits);
+		offset_data[i + 1] = hits.size();
+	}
+	
+	py::array_t<Num> lambdas(hits.size());
+	py::array_t<std::int64_t> indices(hits.size());
+	Num* lambda_data = lambdas.mutable_data();
+	std::int64_t* index_data = indices.mutable_data();
+	
+	for(size_t i = 0; i < hits.size(); ++i) {
+		lambda_data[i] = hits[i].lambda;
+		index_data[i] = hits[i].index;
+	}
+	
+	return py::make_tuple(offsets, lambdas, indices);
+}
+
+// Output array of the batch methods. None allocates a new array, otherwise the given array is checked
+// and filled in place.
+template<typename T>
+py::array_t<T> output_array(py::object out, const std::vector<py::ssize_t>& shape, size_t size, const std::string& name) {
+	if(out.is_none())
+		return py::array_t<T>(shape);
+	
+	if(!py::isinstance<py::array_t<T>>(out))
+		throw std::invalid_argument(name + " must be an array of type " + py::str(py::dtype::of<T>()).cast<std::string>());
+	
+	py::array_t<T> result = out.cast<py::array_t<T>>();
+	
+	if(!(result.flags() & py::array::c_style) || !result.writeable())
+		throw std::invalid_argument(name + " must be writeable and C-contiguous");
+	
+	if((size_t) result.size() != size)
+		throw std::invalid_argument(name + " must hold " + std::to_string(size) + " elements");
+	
+	return result;
+}
+
+// Traces a batch of segments on all threads with the GIL released. l_max is either a single value or one
+// per segment. Returns the (lambda, index) arrays, which are either newly allocated or the given outputs.
+// If sort is set, the segments are traced in ray_order_key order within the given box, which keeps the
+// caches warm for batches in arbitrary order.
+template<typename P, typename Num, typename B, typename F>
+py::tuple trace_batch(PointArray<Num> p1, PointArray<Num> p2, PointArray<Num> l_max, py::object lambda_out, py::object index_out, bool sort, const B& box, F&& trace) {
+	check_points(p1, "Start points");
+	
+	if(p1.ndim() != p2.ndim() || !std::equal(p1.shape(), p1.shape() + p1.ndim(), p2.shape()))
+		throw std::invalid_argument("Start and end points must have the same shape");
+	
+	const size_t n_rays = p1.size() / 3;
+	
+	if(l_max.size() != 1 && (size_t) l_max.size() != n_rays)
+		throw std::invalid_argument("l_max must be a single value or one value per segment");
+	
+	std::vector<py::ssize_t> shape(p1.shape(), p1.shape() + p1.ndim() - 1);
+	py::array_t<Num> lambdas = output_array<Num>(lambda_out, shape, n_rays, "lambda_out");
+	py::array_t<std::int64_t> indices = output_array<std::int64_t>(index_out, shape, n_rays, "index_out");
+	
+	const P* starts = reinterpret_cast<const P*>(p1.data());
+	const P* ends   = reinterpret_cast<const P*>(p2.data());
+	const Num* l_max_data = l_max.data();
+	const size_t l_max_stride = l_max.size() == 1 ? 0 : 1;
+	
+	Num* lambda_data = lambdas.mutable_data();
+	std::int64_t* index_data = indices.mutable_data();
+	
+	{
+		py::gil_scoped_release release;
+		
+		std::vector<size_t> order;
+		if(sort) {
+			std::vector<std::uint64_t> keys(n_rays);
+			tr::parallel::parallel_for(0, n_rays, [&](size_t i) {
+				P direction;
+				for(size_t d = 0; d < 3; ++d)
+					direction[d] = ends[i][d] - starts[i][d];
+				
+				keys[i] = tr::ray_order_key(starts[i], direction, box);
+			}, 4096);
+			
+			order = tr::internal::sort_order(keys);
+		}
+		
+		tr::parallel::parallel_for(0, n_rays, [&](size_t k) {
+			const size_t i = sort ? order[k] : k;
+			const auto hit = trace(starts[i], ends[i], l_max_data[i * l_max_stride]);
+			
+			lambda_data[i] = hit.lambda;
+			index_data[i] = resolve_index(hit);
+		}, 1024);
+	}
+	
+	return py::make_tuple(lambdas, indices);
+}
+
 template<typename Mesh, typename... Options, typename Num = typename Mesh::Point::numeric_type, typename P = tr::point_for<typename Mesh::Node::Point>>
 std::enable_if_t<Mesh::Point::dimension == 3> register_ray_cast(py::class_<Mesh, Options...>& cls) {
 	static_assert(std::is_standard_layout<P>::value, "P must be standard layout");
@@ -204,24 +366,245 @@ std::enable_if_t<Mesh::Point::dimension == 3> register_ray_cast(py::class_<Mesh,
 		return tr::ray_trace<typename Mesh::Grid>(p1, p2, m.grid, l_max).lambda;
 	}));
 	
+	cls.def("ray_cast_wide", py::vectorize([](Mesh& m, P p1, P p2, Num l_max) {
+		return trace_wide(m, p1, p2, l_max).lambda;
+	}));
+	
+	// Batch versions of the above. These run on all threads (see set_num_threads) without holding the GIL
+	// and can write into preallocated outputs. With sort=True, segments are traced in Morton order of their
+	// origins, which is faster for large batches in arbitrary order. Results keep the input order.
+	cls.def("ray_cast_batch", [](Mesh& m, PointArray<Num> p1, PointArray<Num> p2, PointArray<Num> l_max, py::object lambda_out, py::object index_out, bool sort) {
+		const auto root = m.root();
+		
+		return trace_batch<P>(p1, p2, l_max, lambda_out, index_out, sort, root.bounding_box(), [&](const P& start, const P& end, Num l) {
+			return tr::ray_trace(start, end, root, l);
+		});
+	}, py::arg("start"), py::arg("end"), py::arg("l_max"), py::arg("lambda_out") = py::none(), py::arg("index_out") = py::none(), py::arg("sort") = false,
+		"Returns (lambda, index) arrays for a batch of segments, computed in parallel");
+	cls.def("ray_cast_batch_grid", [](Mesh& m, PointArray<Num> p1, PointArray<Num> p2, PointArray<Num> l_max, py::object lambda_out, py::object index_out, bool sort) {
+		return trace_batch<P>(p1, p2, l_max, lambda_out, index_out, sort, m.root().bounding_box(), [&](const P& start, const P& end, Num l) {
+			return tr::ray_trace(start, end, m.grid, l);
+		});
+	}, py::arg("start"), py::arg("end"), py::arg("l_max"), py::arg("lambda_out") = py::none(), py::arg("index_out") = py::none(), py::arg("sort") = false);
+	cls.def("ray_cast_batch_wide", [](Mesh& m, PointArray<Num> p1, PointArray<Num> p2, PointArray<Num> l_max, py::object lambda_out, py::object index_out, bool sort) {
+		// Fail before releasing the GIL if no wide tree was built
+		if(m.wide8.empty() && m.wide4.empty())
+			throw std::logic_error("No wide tree available. Call build_wide() first");
+		
+		return trace_batch<P>(p1, p2, l_max, lambda_out, index_out, sort, m.root().bounding_box(), [&](const P& start, const P& end, Num l) {
+			return trace_wide(m, start, end, l);
+		});
+	}, py::arg("start"), py::arg("end"), py::arg("l_max"), py::arg("lambda_out") = py::none(), py::arg("index_out") = py::none(), py::arg("sort") = false);
+	
+	// Index of the hit triangle (-1 for misses). The tags can be fetched in bulk with get_tags
+	cls.def("ray_cast_index", py::vectorize([](Mesh& m, P p1, P p2, Num l_max) {
+		return resolve_index(tr::ray_trace<typename Mesh::Node>(p1, p2, m.root(), l_max));
+	}));
+	cls.def("ray_cast_index_grid", py::vectorize([](Mesh& m, P p1, P p2, Num l_max) {
+		return resolve_index(tr::ray_trace<typename Mesh::Grid>(p1, p2, m.grid, l_max));
+	}));
+	
+	// Any-hit queries, e.g. for visibility checks. These stop at the first triangle hit found
+	cls.def("occluded", py::vectorize([](Mesh& m, P p1, P p2, Num l_max) {
+		return tr::occluded<typename Mesh::Node>(p1, p2, m.root(), l_max);
+	}));
+	cls.def("occluded_grid", py::vectorize([](Mesh& m, P p1, P p2, Num l_max) {
+		return tr::occluded<typename Mesh::Grid>(p1, p2, m.grid, l_max);
+	}));
+	
+	// Inside tests for closed meshes. contains uses the crossing parity, winding_number the signed crossings
+	cls.def("contains", py::vectorize([](Mesh& m, P p) {
+		return tr::contains<typename Mesh::Node>(p, m.root());
+	}));
+	cls.def("winding_number", py::vectorize([](Mesh& m, P p) {
+		return tr::winding_number<typename Mesh::Node>(p, m.root());
+	}));
+	
+	// All hits along each segment, see trace_all for the layout of the result
+	cls.def("ray_cast_all", [](Mesh& m, PointArray<Num> p1, PointArray<Num> p2, Num l_max) {
+		return trace_all<P>(p1, p2, l_max, [&](const P& start, const P& end, Num l_max, std::vector<tr::RaytraceResult<Num>>& hits) {
+			tr::ray_trace_all<typename Mesh::Node>(start, end, m.root(), l_max, hits);
+		});
+	}, py::arg("start"), py::arg("end"), py::arg("l_max"));
+	cls.def("ray_cast_all_grid", [](Mesh& m, PointArray<Num> p1, PointArray<Num> p2, Num l_max) {
+		return trace_all<P>(p1, p2, l_max, [&](const P& start, const P& end, Num l_max, std::vector<tr::RaytraceResult<Num>>& hits) {
+			tr::ray_trace_all<typename Mesh::Grid>(start, end, m.grid, l_max, hits);
+		});
+	}, py::arg("start"), py::arg("end"), py::arg("l_max"));
+	
 	cls.def("ray_cast_detail", [](Mesh& m, P p1, P p2, Num l_max) {		
-		return tr::ray_trace<typename Mesh::Node>(p1, p2, m.root(), l_max);
+		return resolve_hit(m, tr::ray_trace<typename Mesh::Node>(p1, p2, m.root(), l_max));
 	});
 	cls.def("ray_cast_detail_grid", [](Mesh& m, P p1, P p2, Num l_max) {		
-		return tr::ray_trace<typename Mesh::Grid>(p1, p2, m.grid, l_max);
+		return resolve_hit(m, tr::ray_trace<typename Mesh::Grid>(p1, p2, m.grid, l_max));
+	});
+	cls.def("ray_cast_detail_wide", [](Mesh& m, P p1, P p2, Num l_max) {
+		return resolve_hit(m, trace_wide(m, p1, p2, l_max));
 	});
 }
 
 template<typename Num, typename Tag, typename M>
 void register_ray_cast_result(std::string name, M& m) {
-	using R = tr::RaytraceResult<Num, Tag>;
+	using R = PyRaycastResult<Num, Tag>;
 	
 	py::class_<R>(m, name.c_str())
 		.def_readwrite("lambda", &R::lambda)
+		.def_readwrite("index", &R::index)
 		.def_readwrite("tags", &R::tags)
 	;
 };
 
+// Bulk lookup of the tags of many triangles. Negative indices (misses) yield rows filled with the maximum tag value.
+template<typename Mesh, typename... Options>
+void register_tag_lookup(py::class_<Mesh, Options...>& cls) {
+	using Tag = typename Mesh::Accessor::tag_type;
+	
+	cls.def("get_tags", [](Mesh& m, py::array_t<std::int64_t, py::array::c_style | py::array::forcecast> indices) {
+		const size_t n_tags = m.tag_buffer.shape(1);
+		
+		std::vector<py::ssize_t> shape(indices.shape(), indices.shape() + indices.ndim());
+		shape.push_back(n_tags);
+		
+		py::array_t<Tag> result(shape);
+		Tag* out = result.mutable_data();
+		const std::int64_t* in = indices.data();
+		
+		for(py::ssize_t i = 0; i < indices.size(); ++i) {
+			if(in[i] >= (std::int64_t) m.size())
+				throw std::out_of_range("Triangle index " + std::to_string(in[i]) + " out of range");
+			
+			for(size_t j = 0; j < n_tags; ++j)
+				out[i * n_tags + j] = in[i] < 0 ? std::numeric_limits<Tag>::max() : (Tag) m.tag_buffer(in[i], j);
+		}
+		
+		return result;
+	}, py::arg("indices"));
+}
+
+// Closest points for a batch of query points, computed in parallel. Returns (distance, point, index) with
+// distance = inf and index = -1 where no triangle is closer than d_max.
+template<typename Mesh, typename... Options, typename Num = typename Mesh::Point::numeric_type, typename P = tr::point_for<typename Mesh::Node::Point>>
+std::enable_if_t<Mesh::Point::dimension == 3> register_closest_point(py::class_<Mesh, Options...>& cls) {
+	cls.def("closest_point", [](Mesh& m, PointArray<Num> points, Num d_max) {
+		check_points(points, "Query points");
+		
+		const size_t n_points = points.size() / 3;
+		std::vector<py::ssize_t> shape(points.shape(), points.shape() + points.ndim() - 1);
+		
+		py::array_t<Num> distances(shape);
+		py::array_t<Num> closest(std::vector<py::ssize_t>(points.shape(), points.shape() + points.ndim()));
+		py::array_t<std::int64_t> indices(shape);
+		
+		const P* in = reinterpret_cast<const P*>(points.data());
+		Num* distance_data = distances.mutable_data();
+		P* closest_data = reinterpret_cast<P*>(closest.mutable_data());
+		std::int64_t* index_data = indices.mutable_data();
+		
+		{
+			py::gil_scoped_release release;
+			
+			const auto root = m.root();
+			tr::parallel::parallel_for(0, n_points, [&](size_t i) {
+				const auto result = tr::closest_point(in[i], root, d_max);
+				
+				distance_data[i] = result.distance;
+				index_data[i] = result.hit() ? (std::int64_t) result.index : -1;
+				
+				for(size_t d = 0; d < 3; ++d)
+					closest_data[i][d] = result.hit() ? result.point[d] : std::numeric_limits<Num>::quiet_NaN();
+			}, 256);
+		}
+		
+		return py::make_tuple(distances, closest, indices);
+	}, py::arg("points"), py::arg("d_max") = std::numeric_limits<Num>::infinity());
+}
+
+template<typename Mesh, typename... Options>
+std::enable_if_t<Mesh::Point::dimension != 3> register_closest_point(py::class_<Mesh, Options...>& cls) {
+}
+
+// Runs n_queries range queries in parallel. query(i, out) appends the triangle indices of query i to out.
+// Returns (offsets, indices) where the result of query i is indices[offsets[i]:offsets[i+1]].
+template<typename F>
+py::tuple batch_query(size_t n_queries, F&& query) {
+	std::vector<std::vector<size_t>> results(n_queries);
+	
+	{
+		py::gil_scoped_release release;
+		tr::parallel::parallel_for(0, n_queries, [&](size_t i) { query(i, results[i]); }, 16);
+	}
+	
+	py::array_t<std::int64_t> offsets(n_queries + 1);
+	std::int64_t* offset_data = offsets.mutable_data();
+	
+	offset_data[0] = 0;
+	for(size_t i = 0; i < n_queries; ++i)
+		offset_data[i + 1] = offset_data[i] + results[i].size();
+	
+	py::array_t<std::int64_t> indices(offset_data[n_queries]);
+	std::int64_t* index_data = indices.mutable_data();
+	
+	for(size_t i = 0; i < n_queries; ++i)
+		std::copy(results[i].begin(), results[i].end(), index_data + offset_data[i]);
+	
+	return py::make_tuple(offsets, indices);
+}
+
+// Indices of all triangles intersecting boxes or spheres. The batched versions take arrays of queries and
+// return their results in the layout of batch_query.
+template<typename Mesh, typename... Options, typename Num = typename Mesh::Point::numeric_type, typename P = tr::point_for<typename Mesh::Node::Point>>
+std::enable_if_t<Mesh::Point::dimension == 3> register_range_query(py::class_<Mesh, Options...>& cls) {
+	using Box = tr::Box<P>;
+	
+	cls.def("query_boxes", [](Mesh& m, PointArray<Num> low, PointArray<Num> high) {
+		check_points(low, "Lower corners");
+		
+		if(low.ndim() != high.ndim() || !std::equal(low.shape(), low.shape() + low.ndim(), high.shape()))
+			throw std::invalid_argument("Lower and upper corners must have the same shape");
+		
+		const P* lows  = reinterpret_cast<const P*>(low.data());
+		const P* highs = reinterpret_cast<const P*>(high.data());
+		const auto root = m.root();
+		
+		return batch_query(low.size() / 3, [&](size_t i, std::vector<size_t>& out) {
+			tr::query_box(root, Box(lows[i], highs[i]), out);
+		});
+	}, py::arg("low"), py::arg("high"));
+	
+	cls.def("query_spheres", [](Mesh& m, PointArray<Num> centers, py::array_t<Num, py::array::c_style | py::array::forcecast> radii) {
+		check_points(centers, "Centers");
+		
+		if(radii.size() != centers.size() / 3)
+			throw std::invalid_argument("Number of radii must match the number of centers");
+		
+		const P* center_data = reinterpret_cast<const P*>(centers.data());
+		const Num* radius_data = radii.data();
+		const auto root = m.root();
+		
+		return batch_query(radii.size(), [&](size_t i, std::vector<size_t>& out) {
+			tr::query_sphere(root, center_data[i], radius_data[i], out);
+		});
+	}, py::arg("centers"), py::arg("radii"));
+	
+	cls.def("query_box", [](Mesh& m, P low, P high) {
+		std::vector<size_t> result;
+		tr::query_box(m.root(), Box(low, high), result);
+		
+		return py::array_t<std::int64_t>(result.size(), std::vector<std::int64_t>(result.begin(), result.end()).data());
+	}, py::arg("low"), py::arg("high"));
+	
+	cls.def("query_sphere", [](Mesh& m, P center, Num radius) {
+		std::vector<size_t> result;
+		tr::query_sphere(m.root(), center, radius, result);
+		
+		return py::array_t<std::int64_t>(result.size(), std::vector<std::int64_t>(result.begin(), result.end()).data());
+	}, py::arg("center"), py::arg("radius"));
+}
+
+template<typename Mesh, typename... Options>
+std::enable_if_t<Mesh::Point::dimension != 3> register_range_query(py::class_<Mesh, Options...>& cls) {
+}
+
 template<typename Mesh, typename... Options>
 std::enable_if_t<Mesh::Point::dimension != 3> register_ray_cast(py::class_<Mesh, Options...>& cls) {
 }
@@ -242,8 +625,13 @@ void register_trimesh(std::string name, M& m) {
 		.def("__getitem__", &Root::operator[], py::keep_alive<0, 1>())
 		.def("__len__", &Root::size)
 		.def_readonly("root", &Root::root_data)
+		.def("precompute", &Root::precompute, "Caches the triangle intersection data (9 numbers per triangle) to speed up ray casting. pack and refit keep the cache up to date, but it must be refreshed by calling precompute again after modifying 'data' or 'indices' in-place.")
+		.def("clear_precomputed", &Root::clear_precomputed)
 	;
 	register_ray_cast(mesh_class);
+	register_tag_lookup(mesh_class);
+	register_closest_point(mesh_class);
+	register_range_query(mesh_class);
 };
 
 template<size_t dim, typename M>
@@ -258,12 +646,19 @@ void register_cp_trimesh(std::string name, M& m) {
 	;
 			
 	auto capnp_mesh_class = py::class_<CP, std::shared_ptr<CP>>(m, name.c_str())
-		.def(py::init(&CP::load))
+		.def(py::init(&CP::load), py::arg("filename"), py::arg("mode") = tr::default_load_mode)
 		.def("__getitem__", &CP::operator[], py::keep_alive<0, 1>())
 		.def("__len__", &CP::size)
 		.def_readonly("root", &CP::root_data)
+		.def("sah_cost", [](CP& mesh) { return mesh.sah_cost(); })
+		.def("build_wide", &CP::build_wide, py::arg("width") = 8, "Collapses the tree into a 4- or 8-wide tree used by ray_cast_wide")
+		.def("precompute", &CP::precompute, "Caches the triangle intersection data in memory to speed up ray casting")
+		.def("clear_precomputed", &CP::clear_precomputed)
 	;
 	register_ray_cast(capnp_mesh_class);
+	register_tag_lookup(capnp_mesh_class);
+	register_closest_point(capnp_mesh_class);
+	register_range_query(capnp_mesh_class);
 };
 
 template<size_t dim, typename Num>
@@ -286,6 +681,19 @@ void register_dimnum(std::string name, py::module_& m) {
 		.def_property_readonly("box", [](const ND& nd) { return nd.bounding_box(); })
 	;
 	
+	using FND = tr::FlatNodeData<P>;
+	py::class_<FND>(m, ("FlatNodeData" + name).c_str())
+		.def_property_readonly("range", &FND::range)
+		.def_property_readonly("children", [](const FND& in){
+			std::vector<FND> children;
+			children.reserve(in.n_children());
+			for(size_t i = 0; i < in.n_children(); ++i)
+				children.push_back(in.shared_child(i));
+			return children;
+		})
+		.def_property_readonly("box", [](const FND& nd) { return nd.bounding_box(); })
+	;
+	
 	using CPND = tr::CapnpNodeData<P>;
 	py::class_<CPND>(m, ("CapnpNodeData" + name).c_str())
 		.def_property_readonly("range", &CPND::range)
@@ -307,17 +715,133 @@ void register_dimnum(std::string name, py::module_& m) {
 	register_trimesh<dim, Num, std::uint32_t>("ArrayMesh" + name, m);
 }
 
+tr::RigidTransform<double> make_transform(py::object rotation, py::object translation) {
+	auto result = tr::RigidTransform<double>::identity();
+	
+	if(!rotation.is_none()) {
+		auto array = py::array_t<double, py::array::c_style | py::array::forcecast>::ensure(rotation);
+		if(!array || array.ndim() != 2 || array.shape(0) != 3 || array.shape(1) != 3)
+			throw std::invalid_argument("Rotation must be a 3x3 matrix");
+		
+		for(size_t i = 0; i < 3; ++i) {
+			for(size_t j = 0; j < 3; ++j)
+				result.rotation[i][j] = array.at(i, j);
+		}
+	}
+	
+	if(!translation.is_none()) {
+		auto array = py::array_t<double, py::array::c_style | py::array::forcecast>::ensure(translation);
+		if(!array || array.ndim() != 1 || array.shape(0) != 3)
+			throw std::invalid_argument("Translation must be a vector of length 3");
+		
+		for(size_t i = 0; i < 3; ++i)
+			result.translation[i] = array.at(i);
+	}
+	
+	return result;
+}
+
+void register_scene(py::module& m) {
+	using Scene = tr::Scene<double>;
+	using P = Scene::P;
+	using CP = tr::CapnpTriangleMesh<3, double, uint32_t, uint32_t>;
+	
+	// The tree is rebuilt lazily when instances were added since the last build
+	auto built = [](Scene& s) -> Scene& {
+		if(s.needs_build())
+			s.build();
+		
+		return s;
+	};
+	
+	py::class_<Scene>(m, "Scene", "Meshes placed with rigid transforms under a top-level tree. Instances of the same mesh share its geometry.")
+		.def(py::init<>())
+		.def("add", [](Scene& s, PyArrayTriangleMeshBase& mesh, py::object rotation, py::object translation) {
+			return s.add(mesh.scene_object(), make_transform(rotation, translation));
+		}, py::arg("mesh"), py::arg("rotation") = py::none(), py::arg("translation") = py::none(), py::keep_alive<1, 2>(),
+			"Adds an instance of the mesh, placed at rotation * x + translation, and returns its id")
+		.def("add", [](Scene& s, CP& mesh, py::object rotation, py::object translation) {
+			return s.add(make_scene_object(mesh), make_transform(rotation, translation));
+		}, py::arg("mesh"), py::arg("rotation") = py::none(), py::arg("translation") = py::none(), py::keep_alive<1, 2>())
+		.def("build", &Scene::build, py::arg("size") = 4, "Rebuilds the top-level tree, e.g. after a mesh was repacked or refit")
+		.def("__len__", [](const Scene& s) { return s.instances.size(); })
+		
+		.def("ray_cast", py::vectorize([built](Scene& s, P p1, P p2, double l_max) {
+			return built(s).ray_trace(p1, p2, l_max).lambda;
+		}))
+		
+		// Returns (lambda, instance, index) arrays. Misses have instance and index -1
+		.def("ray_cast_detail", [built](Scene& s, PointArray<double> p1, PointArray<double> p2, double l_max) {
+			check_points(p1, "Start points");
+			
+			if(p1.ndim() != p2.ndim() || !std::equal(p1.shape(), p1.shape() + p1.ndim(), p2.shape()))
+				throw std::invalid_argument("Start and end points must have the same shape");
+			
+			built(s);
+			
+			const size_t n_rays = p1.size() / 3;
+			const P* starts = reinterpret_cast<const P*>(p1.data());
+			const P* ends   = reinterpret_cast<const P*>(p2.data());
+			
+			std::vector<py::ssize_t> shape(p1.shape(), p1.shape() + p1.ndim() - 1);
+			py::array_t<double> lambdas(shape);
+			py::array_t<std::int64_t> instances(shape);
+			py::array_t<std::int64_t> indices(shape);
+			
+			double* lambda_data = lambdas.mutable_data();
+			std::int64_t* instance_data = instances.mutable_data();
+			std::int64_t* index_data = indices.mutable_data();
+			
+			{
+				py::gil_scoped_release release;
+				
+				tr::parallel::parallel_for(0, n_rays, [&](size_t i) {
+					const auto hit = s.ray_trace(starts[i], ends[i], l_max);
+					
+					lambda_data[i] = hit.lambda;
+					instance_data[i] = hit.hit() ? (std::int64_t) hit.instance : -1;
+					index_data[i] = resolve_index(hit);
+				}, 256);
+			}
+			
+			return py::make_tuple(lambdas, instances, indices);
+		}, py::arg("start"), py::arg("end"), py::arg("l_max"))
+	;
+}
+
 PYBIND11_MODULE(tinygeo, m) {
+	py::enum_<tr::PackStrategy>(m, "PackStrategy")
+		.value("str", tr::PackStrategy::str)
+		.value("sah", tr::PackStrategy::sah)
+		.value("lbvh", tr::PackStrategy::lbvh)
+	;
+	
+	py::enum_<tr::VertexEncoding>(m, "VertexEncoding")
+		.value("float64", tr::VertexEncoding::float64)
+		.value("float32", tr::VertexEncoding::float32)
+		.value("quantized16", tr::VertexEncoding::quantized16)
+	;
+	
+	py::enum_<tr::LoadMode>(m, "LoadMode")
+		.value("stream", tr::LoadMode::stream)
+		.value("mmap", tr::LoadMode::mmap)
+		.value("packed", tr::LoadMode::packed)
+	;
+	
 	py::class_<PyArrayTriangleMeshBase>(m, "ArrayMesh")
-		.def_property_readonly("data", &PyArrayTriangleMeshBase::get_data)
-		.def_property_readonly("indices", &PyArrayTriangleMeshBase::get_idx)
+		.def_property_readonly("data", &PyArrayTriangleMeshBase::get_data, "Vertex array. In-place changes require refit (or pack), and precompute if the triangle cache is enabled.")
+		.def_property_readonly("indices", &PyArrayTriangleMeshBase::get_idx, "Triangle index array. In-place changes require pack, and precompute if the triangle cache is enabled.")
 		.def_property_readonly("tags", &PyArrayTriangleMeshBase::get_tags)
 		.def_property_readonly("dim", &PyArrayTriangleMeshBase::get_dim)
 		
 		.def_property("grid_size", &PyArrayTriangleMeshBase::get_grid_size, &PyArrayTriangleMeshBase::set_grid_size)
 		
-		.def("pack", &PyArrayTriangleMeshBase::py_pack)
-		.def("save", &PyArrayTriangleMeshBase::save)
+		.def("pack", &PyArrayTriangleMeshBase::py_pack, py::arg("size"), py::arg("strategy") = tr::PackStrategy::str)
+		.def("refit", &PyArrayTriangleMeshBase::py_refit, "Updates the tree boxes, grid and the triangle cache (if enabled) after the vertices in 'data' were modified in-place. Much cheaper than pack, but the tree quality degrades with large deformations.")
+		.def("sah_cost", &PyArrayTriangleMeshBase::py_sah_cost)
+		.def("build_wide", &PyArrayTriangleMeshBase::py_build_wide, py::arg("width") = 8, "Collapses the packed tree into a 4- or 8-wide tree used by ray_cast_wide")
+		.def("save", &PyArrayTriangleMeshBase::save, py::arg("filename"), py::arg("packed") = false, py::arg("vertices") = tr::VertexEncoding::float64,
+			"Saves the mesh in file version 3, which tinygeo releases without file version support reject. Packed files are smaller but can not be memory-mapped and must be loaded with LoadMode.packed, float32 and quantized16 vertices are lossy")
 	;
 	
 	register_dimnum<1, float>("32_1", m);
@@ -332,9 +856,14 @@ PYBIND11_MODULE(tinygeo, m) {
 	register_cp_trimesh<2>("Capnp_64_2", m);
 	register_cp_trimesh<3>("Capnp_64_3", m);
 	
+	register_scene(m);
+	
 	register_ray_cast_result<float , uint32_t>("RaycastResult_32", m);
 	register_ray_cast_result<double, uint32_t>("RaycastResult_64", m);
 	
+	m.def("set_num_threads", &tr::parallel::set_num_threads, py::arg("n"), "Sets the number of threads used by parallel algorithms (0 = hardware concurrency)");
+	m.def("get_num_threads", &tr::parallel::num_threads);
+	
 	py::array_t<uint32_t> tags_default(py::array::ShapeContainer({(size_t) 0, (size_t) 0}));
 	m.def("mesh", make_mesh, py::arg("vertices"), py::arg("indices"), py::arg("tags") = tags_default);
 }
@@ -0,0 +1,87 @@
+// Checks that the queries on packed meshes do not allocate on the heap. The global allocation functions are
+// replaced by counting versions.
+
+#include "common.h"
+
+#include <cstdlib>
+#include <new>
+#include <string>
+
+#include <tinygeo/distance.h>
+
+using namespace test;
+
+namespace {
+	size_t n_allocations = 0;
+}
+
+void* operator new(size_t size) {
+	++n_allocations;
+	
+	void* result = std::malloc(size == 0 ? 1 : size);
+	if(result == nullptr)
+		throw std::bad_alloc();
+	
+	return result;
+}
+
+void operator delete(void* ptr) noexcept { std::free(ptr); }
+void operator delete(void* ptr, size_t) noexcept { std::free(ptr); }
+
+namespace {
+
+template<typename NodeData, typename GridData>
+void check_mesh(const std::string& name, Checker& check) {
+	using M = Mesh<NodeData, GridData>;
+	
+	VecBuffer<double> points;
+	VecBuffer<uint32_t> indices;
+	VecBuffer<uint32_t> tags;
+	make_torus(48, 24, points, indices, tags);
+	
+	M mesh(points, indices, tags, NodeData(), GridData());
+	mesh.grid.size = {12, 12, 4};
+	mesh.pack(8);
+	mesh.build_wide(8);
+	
+	const auto segments = random_segments(200, 3);
+	const auto root = mesh.root();
+	
+	std::vector<tinygeo::RaytraceResult<double>> hits;
+	hits.reserve(mesh.size());
+	
+	// Runs f on all segments and checks that it did not allocate
+	auto expect_no_allocations = [&](const char* what, auto&& f) {
+		const std::string msg = name + ": " + what;
+		const size_t before = n_allocations;
+		
+		for(const auto& s : segments)
+			f(s.first, s.second);
+		
+		check(n_allocations == before, msg.c_str(), n_allocations - before);
+	};
+	
+	expect_no_allocations("node ray_trace", [&](const P& a, const P& b) { tinygeo::ray_trace(a, b, root, 1.0); });
+	expect_no_allocations("grid ray_trace", [&](const P& a, const P& b) { tinygeo::ray_trace(a, b, mesh.grid, 1.0); });
+	expect_no_allocations("wide ray_trace", [&](const P& a, const P& b) { tinygeo::ray_trace(a, b, mesh.wide8, 1.0); });
+	expect_no_allocations("node occluded", [&](const P& a, const P& b) { tinygeo::occluded(a, b, root, 1.0); });
+	expect_no_allocations("grid occluded", [&](const P& a, const P& b) { tinygeo::occluded(a, b, mesh.grid, 1.0); });
+	expect_no_allocations("node closest_point", [&](const P& a, const P&) { tinygeo::closest_point(a, root); });
+	expect_no_allocations("node contains", [&](const P& a, const P&) { tinygeo::contains(a, root); });
+	
+	expect_no_allocations("node ray_trace_all", [&](const P& a, const P& b) {
+		hits.clear();
+		tinygeo::ray_trace_all(a, b, root, 1.0, hits);
+	});
+}
+
+}
+
+int main() {
+	Checker check;
+	
+	check_mesh<tinygeo::FlatNodeData<P>, tinygeo::CSRGridData>("flat/csr", check);
+	check_mesh<tinygeo::SimpleNodeData<P>, tinygeo::SimpleGridData>("simple/list", check);
+	
+	return check.result();
+}
@@ -0,0 +1,113 @@
+// Measures file size, save time and load time of a large mesh for every vertex encoding and load mode, and for
+// the list-based version 1 layout that preceded the chunked arrays and the encodings. Loads run against a warm
+// page cache, so they show the decoding and copying cost rather than the storage speed. The first ray casts
+// after loading are timed separately, because mapped files only read their pages then.
+//
+// Usage: benchmark_capnp_load [nu nv], saves a torus with 2 nu nv triangles (default 1000 x 500)
+
+#include "common.h"
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <memory>
+#include <string>
+
+#include <tinygeo/capnp.h>
+
+using namespace test;
+
+namespace {
+
+using Loaded = tinygeo::CapnpTriangleMesh<3, double, uint32_t, uint32_t>;
+using Clock = std::chrono::steady_clock;
+
+double ms_since(Clock::time_point start) {
+	return std::chrono::duration<double, std::milli>(Clock::now() - start).count();
+}
+
+long file_size(const std::string& filename) {
+	std::FILE* file = std::fopen(filename.c_str(), "rb");
+	if(file == nullptr)
+		return -1;
+	
+	std::fseek(file, 0, SEEK_END);
+	const long result = std::ftell(file);
+	std::fclose(file);
+	
+	return result;
+}
+
+template<typename M>
+void run(M& mesh, uint32_t version, const char* encoding_name, tinygeo::VertexEncoding encoding, bool packed, const std::vector<std::pair<P, P>>& segments) {
+	constexpr size_t n_repetitions = 5;
+	const std::string filename = "benchmark_load.tgeo";
+	
+	tinygeo::SaveOptions options;
+	options.version = version;
+	options.legacy = version == 1;
+	options.packed = packed;
+	options.vertices = encoding;
+	
+	const auto save_start = Clock::now();
+	tinygeo::capnp::save_file(mesh, filename, options);
+	const double save_ms = ms_since(save_start);
+	
+	auto report = [&](const char* mode_name, tinygeo::LoadMode mode) {
+		double load_ms = 0;
+		double trace_ms = 0;
+		
+		for(size_t i = 0; i < n_repetitions; ++i) {
+			const auto load_start = Clock::now();
+			std::shared_ptr<Loaded> loaded = Loaded::load(filename, mode);
+			load_ms += ms_since(load_start);
+			
+			const auto trace_start = Clock::now();
+			for(const auto& s : segments)
+				tinygeo::ray_trace(s.first, s.second, loaded -> root(), 1.0);
+			trace_ms += ms_since(trace_start);
+		}
+		
+		std::printf("%-7u %-12s %-7s %-7s %10.1f %9.1f %9.2f %12.2f\n", version, encoding_name, packed ? "packed" : "raw", mode_name, file_size(filename) / 1e6, save_ms, load_ms / n_repetitions, trace_ms / n_repetitions);
+	};
+	
+	if(packed) {
+		report("packed", tinygeo::LoadMode::packed);
+	} else {
+		report("stream", tinygeo::LoadMode::stream);
+		report("mmap", tinygeo::LoadMode::mmap);
+	}
+	
+	std::remove(filename.c_str());
+}
+
+}
+
+int main(int argc, char** argv) {
+	const size_t nu = argc > 2 ? std::atoi(argv[1]) : 1000;
+	const size_t nv = argc > 2 ? std::atoi(argv[2]) : 500;
+	
+	VecBuffer<double> points;
+	VecBuffer<uint32_t> indices;
+	VecBuffer<uint32_t> tags;
+	make_torus(nu, nv, points, indices, tags);
+	
+	Mesh<tinygeo::FlatNodeData<P>, tinygeo::CSRGridData> mesh(points, indices, tags, tinygeo::FlatNodeData<P>(), tinygeo::CSRGridData());
+	mesh.grid.size = {64, 64, 16};
+	mesh.pack(8);
+	
+	const auto segments = random_segments(1000, 5);
+	
+	std::printf("%zu triangles, %zu vertices\n", mesh.size(), mesh.point_buffer.shape(0));
+	std::printf("%-7s %-12s %-7s %-7s %10s %9s %9s %12s\n", "version", "vertices", "file", "load", "size [MB]", "save [ms]", "load [ms]", "1k rays [ms]");
+	
+	run(mesh, 1, "float64", tinygeo::VertexEncoding::float64, false, segments);
+	
+	for(bool packed : {false, true}) {
+		run(mesh, 3, "float64", tinygeo::VertexEncoding::float64, packed, segments);
+		run(mesh, 3, "float32", tinygeo::VertexEncoding::float32, packed, segments);
+		run(mesh, 3, "quantized16", tinygeo::VertexEncoding::quantized16, packed, segments);
+	}
+	
+	return 0;
+}
@@ -0,0 +1,222 @@
+// Saves a packed mesh in every file version and encoding, loads it back in every matching load mode and checks
+// that the loaded mesh holds the same data and gives the same ray casts. A large mesh checks arrays that span
+// several chunks.
+
+#include "common.h"
+
+#include <cmath>
+#include <cstdio>
+#include <memory>
+#include <string>
+
+#include <tinygeo/capnp.h>
+
+using namespace test;
+
+namespace {
+
+using Loaded = tinygeo::CapnpTriangleMesh<3, double, uint32_t, uint32_t>;
+
+// Compares a loaded mesh with the saved one: sizes, vertices, indices and tags, and ray casts through the
+// loaded tree and grid
+template<typename M>
+void compare(M& mesh, Loaded& loaded, const std::string& name, Checker& check) {
+	const std::string size_msg = name + ": sizes";
+	check(loaded.point_buffer.shape(0) == mesh.point_buffer.shape(0) && loaded.size() == mesh.size() && loaded.tag_buffer.shape(1) == mesh.tag_buffer.shape(1), size_msg.c_str(), 0);
+	
+	if(loaded.size() != mesh.size() || loaded.point_buffer.shape(0) != mesh.point_buffer.shape(0))
+		return;
+	
+	const std::string points_msg = name + ": vertices";
+	for(size_t i = 0; i < mesh.point_buffer.shape(0); ++i) {
+		for(size_t d = 0; d < 3; ++d)
+			check((double) loaded.point_buffer(i, d) == mesh.point_buffer(i, d), points_msg.c_str(), i);
+	}
+	
+	const std::string indices_msg = name + ": indices and tags";
+	for(size_t i = 0; i < mesh.size(); ++i) {
+		bool same = (uint32_t) loaded.tag_buffer(i, 0) == mesh.tag_buffer(i, 0);
+		for(size_t k = 0; k < 3; ++k)
+			same &= (uint32_t) loaded.index_buffer(i, k) == mesh.index_buffer(i, k);
+		
+		check(same, indices_msg.c_str(), i);
+	}
+	
+	// The loaded tree and grid must answer queries like the saved ones
+	const std::string node_msg = name + ": node ray_trace";
+	const std::string grid_msg = name + ": grid ray_trace";
+	
+	const auto segments = random_segments(300, 11);
+	for(size_t k = 0; k < segments.size(); ++k) {
+		const P& a = segments[k].first;
+		const P& b = segments[k].second;
+		
+		const auto ref = tinygeo::ray_trace(a, b, mesh.root(), 1.0);
+		const auto node_hit = tinygeo::ray_trace(a, b, loaded.root(), 1.0);
+		const auto grid_hit = tinygeo::ray_trace(a, b, loaded.grid, 1.0);
+		
+		check(node_hit.lambda == ref.lambda && node_hit.index == ref.index, node_msg.c_str(), k);
+		check(grid_hit.lambda == ref.lambda, grid_msg.c_str(), k);
+	}
+}
+
+template<typename M>
+void check_roundtrip(M& mesh, uint32_t version, tinygeo::LoadMode mode, Checker& check) {
+	const char* mode_name = mode == tinygeo::LoadMode::mmap ? "/mmap" : mode == tinygeo::LoadMode::packed ? "/packed" : "/stream";
+	const std::string name = std::string("v") + std::to_string(version) + mode_name;
+	const std::string filename = "roundtrip_v" + std::to_string(version) + ".tgeo";
+	
+	tinygeo::SaveOptions options;
+	options.version = version;
+	options.packed = mode == tinygeo::LoadMode::packed;
+	options.legacy = version == 1 || version == 2;
+	tinygeo::capnp::save_file(mesh, filename, options);
+	
+	compare(mesh, *Loaded::load(filename, mode), name, check);
+	std::remove(filename.c_str());
+}
+
+// Lossy vertex encodings: the decoded vertices must be within the encoding error, and the loaded tree and
+// grid (whose boxes and cells are padded by that error) must find the same hits as a brute-force loop over
+// the decoded triangles
+template<typename M>
+void check_lossy_roundtrip(M& mesh, tinygeo::VertexEncoding encoding, tinygeo::LoadMode mode, Checker& check) {
+	const std::string name = std::string(encoding == tinygeo::VertexEncoding::float32 ? "float32" : "quantized16") + (mode == tinygeo::LoadMode::packed ? "/packed" : "/mmap");
+	const std::string filename = "roundtrip_lossy.tgeo";
+	
+	tinygeo::SaveOptions options;
+	options.packed = mode == tinygeo::LoadMode::packed;
+	options.vertices = encoding;
+	tinygeo::capnp::save_file(mesh, filename, options);
+	
+	{
+		std::shared_ptr<Loaded> loaded = Loaded::load(filename, mode);
+		
+		const std::string size_msg = name + ": sizes";
+		check(loaded -> point_buffer.shape(0) == mesh.point_buffer.shape(0) && loaded -> size() == mesh.size(), size_msg.c_str(), 0);
+		
+		if(loaded -> size() != mesh.size() || loaded -> point_buffer.shape(0) != mesh.point_buffer.shape(0)) {
+			std::remove(filename.c_str());
+			return;
+		}
+		
+		const auto frame = mesh.root().bounding_box();
+		
+		const std::string points_msg = name + ": vertex error";
+		for(size_t i = 0; i < mesh.point_buffer.shape(0); ++i) {
+			for(size_t d = 0; d < 3; ++d) {
+				const double extent = frame.max()[d] - frame.min()[d];
+				const double scale = std::max(std::abs(frame.min()[d]), std::abs(frame.max()[d]));
+				const double tol = encoding == tinygeo::VertexEncoding::float32 ? scale * std::numeric_limits<float>::epsilon() : extent / 65535;
+				
+				check(std::abs((double) loaded -> point_buffer(i, d) - mesh.point_buffer(i, d)) <= tol, points_msg.c_str(), i);
+			}
+		}
+		
+		const std::string node_msg = name + ": node ray_trace";
+		const std::string grid_msg = name + ": grid ray_trace";
+		
+		const auto segments = random_segments(300, 13);
+		for(size_t k = 0; k < segments.size(); ++k) {
+			const P& a = segments[k].first;
+			const P& b = segments[k].second;
+			
+			tinygeo::RaytraceResult<double> ref;
+			for(size_t i = 0; i < loaded -> size(); ++i)
+				ref << tinygeo::ray_trace(a, b, (*loaded)[i], 1.0);
+			
+			check(tinygeo::ray_trace(a, b, loaded -> root(), 1.0).lambda == ref.lambda, node_msg.c_str(), k);
+			check(tinygeo::ray_trace(a, b, loaded -> grid, 1.0).lambda == ref.lambda, grid_msg.c_str(), k);
+		}
+	}
+	
+	std::remove(filename.c_str());
+}
+
+// Versions 1 and 2 must only be written on request, old readers load them as empty meshes
+template<typename M>
+void check_legacy_rejected(M& mesh, uint32_t version, Checker& check) {
+	const std::string filename = "roundtrip_legacy.tgeo";
+	
+	tinygeo::SaveOptions options;
+	options.version = version;
+	
+	bool rejected = false;
+	try {
+		tinygeo::capnp::save_file(mesh, filename, options);
+	} catch(std::invalid_argument&) {
+		rejected = true;
+	}
+	
+	check(rejected, "legacy version saved without SaveOptions::legacy", version);
+	std::remove(filename.c_str());
+}
+
+// Packed files must be rejected with an error by the unpacked load modes
+template<typename M>
+void check_packed_rejected(M& mesh, tinygeo::LoadMode mode, Checker& check) {
+	const std::string filename = "roundtrip_packed.tgeo";
+	
+	tinygeo::SaveOptions options;
+	options.packed = true;
+	tinygeo::capnp::save_file(mesh, filename, options);
+	
+	bool rejected = false;
+	try {
+		Loaded::load(filename, mode);
+	} catch(std::runtime_error&) {
+		rejected = true;
+	}
+	
+	check(rejected, mode == tinygeo::LoadMode::mmap ? "packed file rejected by mmap" : "packed file rejected by stream", 0);
+	std::remove(filename.c_str());
+}
+
+}
+
+int main() {
+	Checker check;
+	
+	VecBuffer<double> points;
+	VecBuffer<uint32_t> indices;
+	VecBuffer<uint32_t> tags;
+	make_torus(48, 24, points, indices, tags);
+	
+	Mesh<tinygeo::FlatNodeData<P>, tinygeo::CSRGridData> mesh(points, indices, tags, tinygeo::FlatNodeData<P>(), tinygeo::CSRGridData());
+	mesh.grid.size = {12, 12, 4};
+	mesh.pack(8);
+	
+	for(uint32_t version : {0, 1, 2, 3}) {
+		check_roundtrip(mesh, version, tinygeo::LoadMode::stream, check);
+		check_roundtrip(mesh, version, tinygeo::LoadMode::mmap, check);
+		check_roundtrip(mesh, version, tinygeo::LoadMode::packed, check);
+	}
+	
+	check_packed_rejected(mesh, tinygeo::LoadMode::stream, check);
+	check_packed_rejected(mesh, tinygeo::LoadMode::mmap, check);
+	
+	for(tinygeo::VertexEncoding encoding : {tinygeo::VertexEncoding::float32, tinygeo::VertexEncoding::quantized16}) {
+		check_lossy_roundtrip(mesh, encoding, tinygeo::LoadMode::mmap, check);
+		check_lossy_roundtrip(mesh, encoding, tinygeo::LoadMode::packed, check);
+	}
+	
+	check_legacy_rejected(mesh, 1, check);
+	check_legacy_rejected(mesh, 2, check);
+	
+	// A mesh whose index array (3 * 2 * 2400 * 1200 elements) spans two chunks of 2^24 elements
+	{
+		VecBuffer<double> large_points;
+		VecBuffer<uint32_t> large_indices;
+		VecBuffer<uint32_t> large_tags;
+		make_torus(2400, 1200, large_points, large_indices, large_tags);
+		
+		Mesh<tinygeo::FlatNodeData<P>, tinygeo::CSRGridData> large(large_points, large_indices, large_tags, tinygeo::FlatNodeData<P>(), tinygeo::CSRGridData());
+		large.grid.size = {64, 64, 16};
+		large.pack(8);
+		
+		check_roundtrip(large, 3, tinygeo::LoadMode::mmap, check);
+		check_roundtrip(large, 3, tinygeo::LoadMode::packed, check);
+	}
+	
+	return check.result();
+}
@@ -0,0 +1,120 @@
+#pragma once
+
+#include <array>
+#include <cmath>
+#include <cstdio>
+#include <cstdint>
+#include <limits>
+#include <random>
+#include <stdexcept>
+#include <vector>
+
+#include <tinygeo/buffer.h>
+#include <tinygeo/raytrace.h>
+
+namespace test {
+
+/** Row-major 2D buffer on top of a std::vector */
+template<typename T>
+struct VecBuffer {
+	using Type = T;
+	using Ref = T&;
+	
+	std::vector<T> values;
+	size_t rows;
+	size_t cols;
+	
+	VecBuffer(size_t rows = 0, size_t cols = 0) : values(rows * cols), rows(rows), cols(cols) {}
+	
+	T& operator()(size_t i, size_t j) { return values[i * cols + j]; }
+	const T& operator()(size_t i, size_t j) const { return values[i * cols + j]; }
+	
+	size_t shape(size_t i) const { return i == 0 ? rows : cols; }
+};
+
+using P = tinygeo::Point<3, double>;
+
+template<typename NodeData, typename GridData>
+using Mesh = tinygeo::IndexedTriangleMesh<3, VecBuffer<double>, VecBuffer<uint32_t>, VecBuffer<uint32_t>, NodeData, GridData>;
+
+/** Closed torus with nu x nv quads, slightly perturbed so that few triangles are axis-aligned. Triangle i
+ *  carries the tag i. */
+inline void make_torus(size_t nu, size_t nv, VecBuffer<double>& points, VecBuffer<uint32_t>& indices, VecBuffer<uint32_t>& tags) {
+	const double pi = std::acos(-1.0);
+	
+	std::mt19937 rng(42);
+	std::uniform_real_distribution<double> noise(-0.01, 0.01);
+	
+	points = VecBuffer<double>(nu * nv, 3);
+	for(size_t i = 0; i < nu; ++i) {
+		for(size_t j = 0; j < nv; ++j) {
+			const double u = 2 * pi * i / nu;
+			const double v = 2 * pi * j / nv;
+			const double r = 5 + 1.5 * std::cos(v);
+			
+			points(i * nv + j, 0) = r * std::cos(u) + noise(rng);
+			points(i * nv + j, 1) = r * std::sin(u) + noise(rng);
+			points(i * nv + j, 2) = 1.5 * std::sin(v) + noise(rng);
+		}
+	}
+	
+	indices = VecBuffer<uint32_t>(2 * nu * nv, 3);
+	tags = VecBuffer<uint32_t>(2 * nu * nv, 1);
+	
+	size_t t = 0;
+	for(size_t i = 0; i < nu; ++i) {
+		for(size_t j = 0; j < nv; ++j) {
+			const uint32_t a = i * nv + j;
+			const uint32_t b = ((i + 1) % nu) * nv + j;
+			const uint32_t c = ((i + 1) % nu) * nv + (j + 1) % nv;
+			const uint32_t d = i * nv + (j + 1) % nv;
+			
+			const uint32_t quad[2][3] = {{a, b, c}, {a, c, d}};
+			for(const auto& tri : quad) {
+				for(size_t k = 0; k < 3; ++k)
+					indices(t, k) = tri[k];
+				
+				tags(t, 0) = t;
+				++t;
+			}
+		}
+	}
+}
+
+/** Random segments through the box [-8, 8] x [-8, 8] x [-2, 2] around the torus */
+inline std::vector<std::pair<P, P>> random_segments(size_t n, unsigned int seed) {
+	std::mt19937 rng(seed);
+	std::uniform_real_distribution<double> d(-8, 8);
+	
+	std::vector<std::pair<P, P>> result(n);
+	for(auto& segment : result) {
+		segment.first = P{d(rng), d(rng), d(rng) / 4};
+		segment.second = P{d(rng), d(rng), d(rng) / 4};
+	}
+	
+	return result;
+}
+
+/** Counts failed checks and reports them */
+struct Checker {
+	size_t n_failed = 0;
+	
+	void operator()(bool ok, const char* what, size_t case_index) {
+		if(ok)
+			return;
+		
+		if(n_failed < 20)
+			std::fprintf(stderr, "FAILED: %s (case %zu)\n", what, case_index);
+		
+		++n_failed;
+	}
+	
+	int result() const {
+		if(n_failed > 0)
+			std::fprintf(stderr, "%zu checks failed\n", n_failed);
+		
+		return n_failed == 0 ? 0 : 1;
+	}
+};
+
+}
@@ -0,0 +1,314 @@
+// Compares all accelerated ray queries against a brute-force loop over the triangles, for every pack strategy
+// and node / grid backend. Point containment is compared against the analytic torus, closest points and box and
+// sphere queries against a loop over all triangles.
+
+#include "common.h"
+
+#include <algorithm>
+#include <string>
+
+#include <tinygeo/batch.h>
+#include <tinygeo/distance.h>
+#include <tinygeo/parallel.h>
+#include <tinygeo/query.h>
+
+using namespace test;
+
+namespace {
+
+using Result = tinygeo::RaytraceResult<double>;
+
+struct Segment {
+	P start;
+	P end;
+	double l_max;
+	
+	// Closest hit and all hit triangles, by brute force
+	Result closest;
+	std::vector<size_t> all;
+};
+
+template<typename M>
+std::vector<Segment> brute_force(M& mesh, size_t n, unsigned int seed) {
+	std::vector<Segment> result;
+	
+	for(const auto& s : random_segments(n, seed)) {
+		Segment segment;
+		segment.start = s.first;
+		segment.end = s.second;
+		segment.l_max = result.size() % 3 == 2 ? 0.5 : 1.0;
+		
+		for(size_t i = 0; i < mesh.size(); ++i) {
+			const Result hit = tinygeo::ray_trace(segment.start, segment.end, mesh[i], segment.l_max);
+			
+			if(!hit.hit())
+				continue;
+			
+			segment.closest << hit;
+			segment.all.push_back(i);
+		}
+		
+		result.push_back(segment);
+	}
+	
+	return result;
+}
+
+// Hits agree if they are at the same distance. Ties between triangles (e.g. on a shared edge) may be resolved
+// either way, as long as the reported triangle is hit at that distance.
+template<typename M>
+bool same_hit(M& mesh, const Segment& segment, const Result& hit) {
+	const Result& ref = segment.closest;
+	
+	if(!ref.hit() || !hit.hit())
+		return ref.hit() == hit.hit();
+	
+	const double tol = 1e-12 * (1 + std::abs(ref.lambda));
+	if(std::abs(hit.lambda - ref.lambda) > tol || hit.index >= mesh.size())
+		return false;
+	
+	if(hit.index == ref.index)
+		return true;
+	
+	const Result tie = tinygeo::ray_trace(segment.start, segment.end, mesh[hit.index], segment.l_max);
+	return std::abs(tie.lambda - ref.lambda) <= tol;
+}
+
+// Points at distance rho from the center circle of the torus built by make_torus, and the point containment
+// tests. Mesh and analytic torus differ by the chords and the noise, about 0.02, so points closer than 0.1 to
+// the surface are skipped.
+template<typename M>
+void check_contains(M& mesh, const std::string& name, Checker& check) {
+	const double pi = std::acos(-1.0);
+	const auto root = mesh.root();
+	
+	auto torus_point = [](double u, double v, double rho) {
+		const double r = 5 + rho * std::cos(v);
+		return P{r * std::cos(u), r * std::sin(u), rho * std::sin(v)};
+	};
+	
+	auto rho_of = [](const P& p) {
+		return std::hypot(std::hypot(p[0], p[1]) - 5, p[2]);
+	};
+	
+	std::vector<P> points;
+	
+	std::mt19937 rng(11);
+	std::uniform_real_distribution<double> angle(0, 2 * pi);
+	std::uniform_real_distribution<double> radius(0, 3);
+	for(size_t i = 0; i < 1000; ++i)
+		points.push_back(torus_point(angle(rng), angle(rng), radius(rng)));
+	
+	// Points whose first ray (see internal::cast_inside_ray) runs through a vertex or the midpoint of an edge
+	const double dir[3] = {0.2361, 0.6180, 0.7498};
+	auto behind = [&](const P& target) {
+		for(double t : {0.3, 1.0, 2.5})
+			points.push_back(P{target[0] - t * dir[0], target[1] - t * dir[1], target[2] - t * dir[2]});
+	};
+	
+	for(size_t i = 0; i < mesh.point_buffer.shape(0); i += 7)
+		behind(P{mesh.point_buffer(i, 0), mesh.point_buffer(i, 1), mesh.point_buffer(i, 2)});
+	
+	for(size_t i = 0; i < mesh.size(); i += 11) {
+		const P a = mesh[i].template get<0>();
+		const P b = mesh[i].template get<1>();
+		behind(P{(a[0] + b[0]) / 2, (a[1] + b[1]) / 2, (a[2] + b[2]) / 2});
+	}
+	
+	const std::string msg = name + ": contains";
+	for(size_t k = 0; k < points.size(); ++k) {
+		const double rho = rho_of(points[k]);
+		if(std::abs(rho - 1.5) < 0.1)
+			continue;
+		
+		check(tinygeo::contains(points[k], root) == (rho < 1.5), msg.c_str(), k);
+	}
+}
+
+// Closest points of random points in and around the torus, against the closest point over all triangles
+template<typename M>
+void check_closest_point(M& mesh, const std::string& name, Checker& check) {
+	const auto root = mesh.root();
+	
+	const std::string msg = name + ": closest_point";
+	const std::string limit_msg = name + ": closest_point with d_max";
+	
+	const auto segments = random_segments(200, 13);
+	for(size_t k = 0; k < 2 * segments.size(); ++k) {
+		const P& p = k % 2 == 0 ? segments[k / 2].first : segments[k / 2].second;
+		
+		tinygeo::ClosestPointResult<P> ref;
+		for(size_t i = 0; i < mesh.size(); ++i)
+			ref << tinygeo::closest_point(p, mesh[i]);
+		
+		// Ties between triangles may be resolved either way, the reported one must be at the same distance
+		const auto result = tinygeo::closest_point(p, root);
+		bool ok = result.hit() && result.distance == ref.distance && result.index < mesh.size();
+		if(ok) {
+			const auto own = tinygeo::closest_point(p, mesh[result.index]);
+			ok = own.distance == ref.distance;
+			for(size_t d = 0; d < 3; ++d)
+				ok = ok && own.point[d] == result.point[d];
+		}
+		check(ok, msg.c_str(), k);
+		
+		// Triangles beyond d_max are ignored
+		const auto below = tinygeo::closest_point(p, root, 0.5 * ref.distance);
+		const auto above = tinygeo::closest_point(p, root, 2 * ref.distance + 0.1);
+		check(!below.hit() && above.hit() && above.distance == ref.distance, limit_msg.c_str(), k);
+	}
+}
+
+// Box and sphere queries of random sizes around the torus, against the intersection tests of all triangles
+template<typename M>
+void check_range_queries(M& mesh, const std::string& name, Checker& check) {
+	const auto root = mesh.root();
+	
+	const std::string box_msg = name + ": query_box";
+	const std::string sphere_msg = name + ": query_sphere";
+	
+	std::mt19937 rng(19);
+	std::uniform_real_distribution<double> extent(0.05, 2);
+	
+	std::vector<size_t> ref;
+	std::vector<size_t> result;
+	
+	const auto segments = random_segments(200, 23);
+	for(size_t k = 0; k < segments.size(); ++k) {
+		const P& c = segments[k].first;
+		
+		const double h[3] = {extent(rng), extent(rng), extent(rng)};
+		const tinygeo::Box<P> box(P{c[0] - h[0], c[1] - h[1], c[2] - h[2]}, P{c[0] + h[0], c[1] + h[1], c[2] + h[2]});
+		
+		ref.clear();
+		for(size_t i = 0; i < mesh.size(); ++i) {
+			if(tinygeo::intersects_box(mesh[i], box))
+				ref.push_back(i);
+		}
+		
+		result.clear();
+		tinygeo::query_box(root, box, result);
+		check(result == ref, box_msg.c_str(), k);
+		
+		const double radius = extent(rng);
+		
+		ref.clear();
+		for(size_t i = 0; i < mesh.size(); ++i) {
+			if(tinygeo::intersects_sphere(mesh[i], c, radius))
+				ref.push_back(i);
+		}
+		
+		result.clear();
+		tinygeo::query_sphere(root, c, radius, result);
+		check(result == ref, sphere_msg.c_str(), k);
+	}
+}
+
+template<typename NodeData, typename GridData>
+void check_mesh(const std::string& name, tinygeo::PackStrategy strategy, Checker& check) {
+	using M = Mesh<NodeData, GridData>;
+	
+	VecBuffer<double> points;
+	VecBuffer<uint32_t> indices;
+	VecBuffer<uint32_t> tags;
+	make_torus(48, 24, points, indices, tags);
+	
+	M mesh(points, indices, tags, NodeData(), GridData());
+	mesh.grid.size = {12, 12, 4};
+	mesh.pack(8, strategy);
+	
+	const std::vector<Segment> segments = brute_force(mesh, 400, 7);
+	const auto root = mesh.root();
+	
+	const std::string node_msg = name + ": node ray_trace";
+	const std::string grid_msg = name + ": grid ray_trace";
+	const std::string occ_node_msg = name + ": node occluded";
+	const std::string occ_grid_msg = name + ": grid occluded";
+	const std::string all_node_msg = name + ": node ray_trace_all";
+	const std::string all_grid_msg = name + ": grid ray_trace_all";
+	
+	auto hit_indices = [](const std::vector<Result>& hits) {
+		std::vector<size_t> result;
+		for(const Result& hit : hits)
+			result.push_back(hit.index);
+		
+		std::sort(result.begin(), result.end());
+		return result;
+	};
+	
+	for(size_t k = 0; k < segments.size(); ++k) {
+		const Segment& s = segments[k];
+		
+		check(same_hit(mesh, s, tinygeo::ray_trace(s.start, s.end, root, s.l_max)), node_msg.c_str(), k);
+		check(same_hit(mesh, s, tinygeo::ray_trace(s.start, s.end, mesh.grid, s.l_max)), grid_msg.c_str(), k);
+		
+		check(tinygeo::occluded(s.start, s.end, root, s.l_max) == s.closest.hit(), occ_node_msg.c_str(), k);
+		check(tinygeo::occluded(s.start, s.end, mesh.grid, s.l_max) == s.closest.hit(), occ_grid_msg.c_str(), k);
+		
+		std::vector<Result> hits;
+		tinygeo::ray_trace_all(s.start, s.end, root, s.l_max, hits);
+		check(hit_indices(hits) == s.all, all_node_msg.c_str(), k);
+		
+		hits.clear();
+		tinygeo::ray_trace_all(s.start, s.end, mesh.grid, s.l_max, hits);
+		check(hit_indices(hits) == s.all, all_grid_msg.c_str(), k);
+	}
+	
+	check_contains(mesh, name, check);
+	check_closest_point(mesh, name, check);
+	check_range_queries(mesh, name, check);
+	
+	// Wide trees, built one at a time
+	const std::string wide4_msg = name + ": wide4 ray_trace";
+	const std::string wide8_msg = name + ": wide8 ray_trace";
+	
+	mesh.build_wide(4);
+	for(size_t k = 0; k < segments.size(); ++k) {
+		const Segment& s = segments[k];
+		check(same_hit(mesh, s, tinygeo::ray_trace(s.start, s.end, mesh.wide4, s.l_max)), wide4_msg.c_str(), k);
+	}
+	
+	mesh.build_wide(8);
+	for(size_t k = 0; k < segments.size(); ++k) {
+		const Segment& s = segments[k];
+		check(same_hit(mesh, s, tinygeo::ray_trace(s.start, s.end, mesh.wide8, s.l_max)), wide8_msg.c_str(), k);
+	}
+	
+	// Packet traversal, in both orders and on one and several threads
+	for(size_t n_threads : {1, 4}) {
+		tinygeo::parallel::set_num_threads(n_threads);
+		
+		for(tinygeo::RayOrder order : {tinygeo::RayOrder::keep, tinygeo::RayOrder::morton}) {
+			const std::string batch_msg = name + ": trace_batch (" + std::to_string(n_threads) + " threads, " + (order == tinygeo::RayOrder::keep ? "keep" : "morton") + ")";
+			
+			tinygeo::RayBatch<double> batch(segments.size());
+			for(size_t k = 0; k < segments.size(); ++k)
+				batch.set(k, segments[k].start, segments[k].end, segments[k].l_max);
+			
+			tinygeo::trace_batch(mesh, batch, order);
+			
+			for(size_t k = 0; k < segments.size(); ++k)
+				check(same_hit(mesh, segments[k], batch.result(k)), batch_msg.c_str(), k);
+		}
+	}
+	
+	tinygeo::parallel::set_num_threads(0);
+}
+
+template<typename NodeData, typename GridData>
+void check_strategies(const std::string& backend, Checker& check) {
+	check_mesh<NodeData, GridData>(backend + "/str", tinygeo::PackStrategy::str, check);
+	check_mesh<NodeData, GridData>(backend + "/sah", tinygeo::PackStrategy::sah, check);
+	check_mesh<NodeData, GridData>(backend + "/lbvh", tinygeo::PackStrategy::lbvh, check);
+}
+
+}
+
+int main() {
+	Checker check;
+	
+	check_strategies<tinygeo::FlatNodeData<P>, tinygeo::CSRGridData>("flat/csr", check);
+	check_strategies<tinygeo::SimpleNodeData<P>, tinygeo::SimpleGridData>("simple/list", check);
+	
+	return check.result();
+}
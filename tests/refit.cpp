@@ -0,0 +1,106 @@
+// Deforms packed meshes and checks that refit() keeps node and grid queries correct: against a brute-force loop
+// over the deformed triangles and against a freshly packed copy. Covers deformations that stay within the
+// frame of the grid (incremental cell update) and ones that leave it (repack), and that copies of the mesh are not
+// affected.
+
+#include "common.h"
+
+#include <string>
+
+using namespace test;
+
+namespace {
+
+template<typename NodeData, typename GridData>
+void check_queries(Mesh<NodeData, GridData>& mesh, const std::string& name, Checker& check) {
+	Mesh<NodeData, GridData> fresh(mesh.point_buffer, mesh.index_buffer, mesh.tag_buffer, NodeData(), GridData());
+	fresh.grid.size = mesh.grid.size;
+	fresh.pack(8);
+	
+	const std::string node_msg = name + ": node ray_trace";
+	const std::string grid_msg = name + ": grid ray_trace";
+	const std::string fresh_msg = name + ": freshly packed ray_trace";
+	
+	const auto segments = random_segments(400, 17);
+	for(size_t k = 0; k < segments.size(); ++k) {
+		const P& a = segments[k].first;
+		const P& b = segments[k].second;
+		
+		tinygeo::RaytraceResult<double> ref;
+		for(size_t i = 0; i < mesh.size(); ++i)
+			ref << tinygeo::ray_trace(a, b, mesh[i], 1.0);
+		
+		check(tinygeo::ray_trace(a, b, mesh.root(), 1.0).lambda == ref.lambda, node_msg.c_str(), k);
+		check(tinygeo::ray_trace(a, b, mesh.grid, 1.0).lambda == ref.lambda, grid_msg.c_str(), k);
+		check(tinygeo::ray_trace(a, b, fresh.root(), 1.0).lambda == ref.lambda && tinygeo::ray_trace(a, b, fresh.grid, 1.0).lambda == ref.lambda, fresh_msg.c_str(), k);
+	}
+}
+
+// Applies f to every vertex with x > 0, i.e. to one half of the torus
+template<typename M, typename F>
+void deform(M& mesh, F&& f) {
+	for(size_t i = 0; i < mesh.point_buffer.shape(0); ++i) {
+		double p[3] = {mesh.point_buffer(i, 0), mesh.point_buffer(i, 1), mesh.point_buffer(i, 2)};
+		if(p[0] <= 0)
+			continue;
+		
+		f(p);
+		for(size_t d = 0; d < 3; ++d)
+			mesh.point_buffer(i, d) = p[d];
+	}
+}
+
+template<typename NodeData, typename GridData>
+void check_mesh(const std::string& name, Checker& check) {
+	VecBuffer<double> points;
+	VecBuffer<uint32_t> indices;
+	VecBuffer<uint32_t> tags;
+	make_torus(48, 24, points, indices, tags);
+	
+	Mesh<NodeData, GridData> mesh(points, indices, tags, NodeData(), GridData());
+	mesh.grid.size = {12, 12, 4};
+	mesh.pack(8);
+	
+	// Copies hold their own tree and grid, refitting the original must not change them
+	Mesh<NodeData, GridData> copy(mesh);
+	
+	// Flatten and pull in one half. The mesh stays within the frame, so only the moved triangles are updated.
+	deform(mesh, [](double* p) {
+		p[0] *= 0.8;
+		p[2] *= 0.5;
+	});
+	mesh.refit();
+	
+	check(!mesh.grid.root_framed(), (name + ": frame kept").c_str(), 0);
+	check_queries(mesh, name + "/inside frame", check);
+	check_queries(copy, name + "/copy", check);
+	
+	// Move it back
+	deform(mesh, [](double* p) {
+		p[0] /= 0.8;
+		p[2] /= 0.5;
+	});
+	mesh.refit();
+	check_queries(mesh, name + "/restored", check);
+	
+	// Stretch the half beyond the frame, which repacks the grid
+	deform(mesh, [](double* p) {
+		p[0] *= 1.3;
+		p[2] *= 1.2;
+	});
+	mesh.refit();
+	
+	check(mesh.grid.root_framed(), (name + ": repacked").c_str(), 0);
+	check_queries(mesh, name + "/outside frame", check);
+}
+
+}
+
+int main() {
+	Checker check;
+	
+	check_mesh<tinygeo::FlatNodeData<P>, tinygeo::CSRGridData>("flat/csr", check);
+	check_mesh<tinygeo::SimpleNodeData<P>, tinygeo::SimpleGridData>("simple/list", check);
+	
+	return check.result();
+}
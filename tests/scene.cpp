@@ -0,0 +1,130 @@
+// Traces a scene with two rotated and translated instances of one mesh and compares the hits against a
+// brute-force loop over copies of the mesh whose vertices were transformed instead.
+
+#include "common.h"
+
+#include <memory>
+#include <string>
+
+#include <tinygeo/scene.h>
+
+using namespace test;
+
+namespace {
+
+using Transform = tinygeo::RigidTransform<double>;
+using Result = tinygeo::RaytraceResult<double>;
+
+// Rotation by angle around one of the coordinate axes, followed by a translation
+Transform rotation(size_t axis, double angle, const P& translation) {
+	Transform result = Transform::identity();
+	
+	const size_t i = (axis + 1) % 3;
+	const size_t j = (axis + 2) % 3;
+	
+	result.rotation[i][i] = std::cos(angle);
+	result.rotation[i][j] = -std::sin(angle);
+	result.rotation[j][i] = std::sin(angle);
+	result.rotation[j][j] = std::cos(angle);
+	
+	for(size_t d = 0; d < 3; ++d)
+		result.translation[d] = translation[d];
+	
+	return result;
+}
+
+// Segments are transformed into the frame of each instance, so lambda only agrees up to rounding
+bool same_lambda(double a, double b) {
+	return std::abs(a - b) <= 1e-9 * (1 + std::abs(b));
+}
+
+template<typename NodeData, typename GridData>
+void check_scene(const std::string& name, Checker& check) {
+	using M = Mesh<NodeData, GridData>;
+	
+	VecBuffer<double> points;
+	VecBuffer<uint32_t> indices;
+	VecBuffer<uint32_t> tags;
+	make_torus(48, 24, points, indices, tags);
+	
+	M mesh(points, indices, tags, NodeData(), GridData());
+	mesh.pack(8);
+	
+	// The second instance stands upright and links with the first one
+	const Transform transforms[2] = {
+		rotation(2, 0.5, P{1, -0.5, 0.2}),
+		rotation(0, 1.5, P{5, 0.3, -0.1})
+	};
+	
+	tinygeo::Scene<double> scene;
+	const auto object = std::make_shared<tinygeo::MeshObject<M>>(mesh);
+	for(const Transform& t : transforms)
+		scene.add(object, t);
+	scene.build();
+	
+	// Copies in the packed triangle order, so that triangle indices agree with the scene hits
+	std::vector<M> copies;
+	for(const Transform& t : transforms) {
+		copies.push_back(mesh);
+		
+		M& copy = copies.back();
+		for(size_t i = 0; i < copy.point_buffer.shape(0); ++i) {
+			const P p = t.apply(P{copy.point_buffer(i, 0), copy.point_buffer(i, 1), copy.point_buffer(i, 2)});
+			for(size_t d = 0; d < 3; ++d)
+				copy.point_buffer(i, d) = p[d];
+		}
+	}
+	
+	const std::string msg = name + ": scene ray_trace";
+	
+	const auto segments = random_segments(400, 29);
+	size_t n_hits[2] = {0, 0};
+	
+	for(size_t k = 0; k < segments.size(); ++k) {
+		const P& a = segments[k].first;
+		const P& b = segments[k].second;
+		const double l_max = k % 3 == 2 ? 0.5 : 1.0;
+		
+		Result ref;
+		size_t ref_instance = 0;
+		for(size_t j = 0; j < copies.size(); ++j) {
+			for(size_t i = 0; i < copies[j].size(); ++i) {
+				const Result hit = tinygeo::ray_trace(a, b, copies[j][i], l_max);
+				
+				if(hit.lambda < ref.lambda) {
+					ref = hit;
+					ref_instance = j;
+				}
+			}
+		}
+		
+		const tinygeo::SceneHit<double> hit = scene.ray_trace(a, b, l_max);
+		
+		if(!ref.hit() || !hit.hit()) {
+			check(ref.hit() == hit.hit(), msg.c_str(), k);
+			continue;
+		}
+		
+		// Ties (e.g. on a shared edge) may be resolved either way, the reported triangle must be hit there
+		bool ok = hit.instance < copies.size() && hit.index < mesh.size() && same_lambda(hit.lambda, ref.lambda);
+		if(ok && (hit.instance != ref_instance || hit.index != ref.index))
+			ok = same_lambda(tinygeo::ray_trace(a, b, copies[hit.instance][hit.index], l_max).lambda, ref.lambda);
+		
+		check(ok, msg.c_str(), k);
+		++n_hits[ref_instance];
+	}
+	
+	// Both instances are actually hit
+	check(n_hits[0] > 0 && n_hits[1] > 0, (name + ": hits on both instances").c_str(), 0);
+}
+
+}
+
+int main() {
+	Checker check;
+	
+	check_scene<tinygeo::FlatNodeData<P>, tinygeo::CSRGridData>("flat/csr", check);
+	check_scene<tinygeo::SimpleNodeData<P>, tinygeo::SimpleGridData>("simple/list", check);
+	
+	return check.result();
+}